@@ -0,0 +1,626 @@
+/*
+ *  Benchmark and stress harness for the Virtio Wayland Driver
+ *  Copyright (C) 2017 Google, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+/*
+Runs a reproducible workload against /dev/wl0 from inside a guest and reports
+latency percentiles and rates. Each of the -c threads opens its own context,
+and the host compositor on the other end is the peer:
+
+pingpong	one wl_display.sync at a time, timed until its wl_callback.done
+stream		bursts of -s bytes of syncs, -w bursts in flight
+streamfd	like stream, but each burst also creates and destroys a wl_shm
+		pool on an allocation VFD, so every message carries an fd
+alloc		VIRTWL_IOCTL_NEW of a -s byte allocation, then close
+mmap		like alloc, but the allocation is also mapped and written
+
+Only core protocol requests are sent so that any compositor accepts them.
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../virtwl.h"
+
+#define WL_DISPLAY_ID 1
+#define WL_DISPLAY_SYNC 0
+#define WL_DISPLAY_GET_REGISTRY 1
+#define WL_DISPLAY_ERROR 0
+#define WL_REGISTRY_BIND 0
+#define WL_REGISTRY_GLOBAL 0
+#define WL_CALLBACK_DONE 0
+#define WL_SHM_CREATE_POOL 0
+#define WL_SHM_POOL_DESTROY 1
+
+/* the largest recv the driver hands back in one message */
+#define RECV_SIZE 4096
+#define BUF_SIZE (16 * RECV_SIZE)
+
+enum mode {
+	MODE_PINGPONG,
+	MODE_STREAM,
+	MODE_STREAMFD,
+	MODE_ALLOC,
+	MODE_MMAP,
+};
+
+static const char *const mode_names[] = {
+	[MODE_PINGPONG] = "pingpong",
+	[MODE_STREAM] = "stream",
+	[MODE_STREAMFD] = "streamfd",
+	[MODE_ALLOC] = "alloc",
+	[MODE_MMAP] = "mmap",
+};
+
+struct options {
+	const char *dev;
+	enum mode mode;
+	unsigned int contexts;
+	unsigned long iters;
+	unsigned int size;
+	unsigned int window;
+	unsigned int ctx_flags;
+};
+
+static struct options opts = {
+	.dev = "/dev/wl0",
+	.mode = MODE_PINGPONG,
+	.contexts = 1,
+	.iters = 10000,
+	.size = 4096,
+	.window = 8,
+};
+
+struct ctx {
+	int wl_fd;
+	int fd;
+	uint32_t next_id;
+	uint32_t shm_id;
+	uint8_t buf[BUF_SIZE];
+	size_t len;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int index;
+	struct ctx ctx;
+	uint64_t *lat_ns; /* one sample per iteration */
+	unsigned long samples;
+	uint64_t msgs;
+	uint64_t bytes;
+	int err;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int new_ctx(struct ctx *ctx, int wl_fd)
+{
+	struct virtwl_ioctl_new new = {
+		.type = VIRTWL_IOCTL_NEW_CTX,
+		.flags = opts.ctx_flags,
+	};
+
+	if (ioctl(wl_fd, VIRTWL_IOCTL_NEW, &new))
+		return -errno;
+
+	ctx->wl_fd = wl_fd;
+	ctx->fd = new.fd;
+	ctx->next_id = 2;
+	ctx->len = 0;
+	return 0;
+}
+
+static int new_alloc(int wl_fd, unsigned int size)
+{
+	struct virtwl_ioctl_new new = {
+		.type = VIRTWL_IOCTL_NEW_ALLOC,
+		.size = size,
+	};
+
+	if (ioctl(wl_fd, VIRTWL_IOCTL_NEW, &new))
+		return -errno;
+
+	return new.fd;
+}
+
+static int ctx_send(struct ctx *ctx, const void *data, size_t len,
+		    const int *fds, unsigned int fd_count)
+{
+	struct virtwl_ioctl_txnx txnx = {
+		.fd_count = fd_count,
+		.len = len,
+		.fds = (uintptr_t)fds,
+		.data = (uintptr_t)data,
+	};
+
+	while (ioctl(ctx->fd, VIRTWL_IOCTL_SENDX, &txnx)) {
+		if (errno != EINTR && errno != EAGAIN)
+			return -errno;
+	}
+
+	return 0;
+}
+
+/* Appends one recv to the buffer, waiting for it. Received fds are closed. */
+static int ctx_recv(struct ctx *ctx)
+{
+	struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+	int fds[VIRTWL_SEND_MAX_ALLOCS];
+	struct virtwl_ioctl_txnx txnx;
+	unsigned int i;
+
+	if (BUF_SIZE - ctx->len < RECV_SIZE)
+		return -ENOBUFS;
+
+	for (;;) {
+		txnx.fd_count = VIRTWL_SEND_MAX_ALLOCS;
+		txnx.len = RECV_SIZE;
+		txnx.fds = (uintptr_t)fds;
+		txnx.data = (uintptr_t)(ctx->buf + ctx->len);
+		if (!ioctl(ctx->fd, VIRTWL_IOCTL_RECVX, &txnx)) {
+			if (txnx.len || txnx.fd_count)
+				break;
+		} else if (errno != EAGAIN && errno != EINTR) {
+			return -errno;
+		}
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+		if (pfd.revents & (POLLHUP | POLLERR))
+			return -EPIPE;
+	}
+
+	for (i = 0; i < txnx.fd_count; i++)
+		close(fds[i]);
+	ctx->len += txnx.len;
+	return 0;
+}
+
+/*
+ * Consumes whole messages from the buffer until a wl_callback.done for id is
+ * seen, calling on_event for each message on the way. Returns the number of
+ * messages consumed.
+ */
+static long ctx_wait_done(struct ctx *ctx, uint32_t id,
+			  void (*on_event)(struct ctx *ctx, const uint32_t *msg))
+{
+	long msgs = 0;
+	size_t off = 0;
+	int ret;
+
+	for (;;) {
+		while (ctx->len - off >= 8) {
+			const uint32_t *msg = (const uint32_t *)(ctx->buf + off);
+			uint32_t size = msg[1] >> 16;
+			uint32_t opcode = msg[1] & 0xffff;
+
+			if (size < 8 || size & 3)
+				return -EPROTO;
+			if (ctx->len - off < size)
+				break;
+
+			off += size;
+			msgs++;
+			if (msg[0] == WL_DISPLAY_ID && opcode == WL_DISPLAY_ERROR) {
+				fprintf(stderr, "compositor error %u on object %u\n",
+					msg[3], msg[2]);
+				return -EPROTO;
+			}
+			if (on_event)
+				on_event(ctx, msg);
+			if (opcode == WL_CALLBACK_DONE && msg[0] == id) {
+				memmove(ctx->buf, ctx->buf + off, ctx->len - off);
+				ctx->len -= off;
+				return msgs;
+			}
+		}
+
+		memmove(ctx->buf, ctx->buf + off, ctx->len - off);
+		ctx->len -= off;
+		off = 0;
+		ret = ctx_recv(ctx);
+		if (ret)
+			return ret;
+	}
+}
+
+/* Writes a wl_display.sync to msg and returns its callback id. */
+static uint32_t put_sync(struct ctx *ctx, uint32_t *msg)
+{
+	msg[0] = WL_DISPLAY_ID;
+	msg[1] = 12 << 16 | WL_DISPLAY_SYNC;
+	msg[2] = ctx->next_id++;
+	return msg[2];
+}
+
+static void on_global(struct ctx *ctx, const uint32_t *msg)
+{
+	uint32_t size = msg[1] >> 16;
+
+	/* registry id 2: global(name, string interface, version) */
+	if (msg[0] != 2 || (msg[1] & 0xffff) != WL_REGISTRY_GLOBAL ||
+	    size < 20 || msg[3] > size - 20)
+		return;
+	if (msg[3] == sizeof("wl_shm") && !strcmp((const char *)&msg[4], "wl_shm"))
+		ctx->shm_id = msg[2];
+}
+
+/* Binds wl_shm as object 4, with the registry as 2 and a callback as 3. */
+static int ctx_bind_shm(struct ctx *ctx)
+{
+	uint32_t msg[11];
+	long ret;
+
+	msg[0] = WL_DISPLAY_ID;
+	msg[1] = 12 << 16 | WL_DISPLAY_GET_REGISTRY;
+	msg[2] = 2;
+	ctx->next_id = 3;
+	put_sync(ctx, &msg[3]);
+	ret = ctx_send(ctx, msg, 24, NULL, 0);
+	if (!ret)
+		ret = ctx_wait_done(ctx, 3, on_global);
+	if (ret < 0)
+		return ret;
+	if (!ctx->shm_id)
+		return -ENOENT;
+
+	msg[0] = 2;
+	msg[1] = 32 << 16 | WL_REGISTRY_BIND;
+	msg[2] = ctx->shm_id;
+	msg[3] = sizeof("wl_shm");
+	memcpy(&msg[4], "wl_shm\0", 8);
+	msg[6] = 1; /* version */
+	msg[7] = 4;
+	ctx->next_id = 5;
+	put_sync(ctx, &msg[8]);
+	ret = ctx_send(ctx, msg, 44, NULL, 0);
+	if (!ret)
+		ret = ctx_wait_done(ctx, msg[10], NULL);
+	return ret < 0 ? ret : 0;
+}
+
+static int run_pingpong(struct worker *w)
+{
+	struct ctx *ctx = &w->ctx;
+	uint32_t msg[3];
+	unsigned long i;
+	uint64_t start;
+	long ret;
+
+	for (i = 0; i < opts.iters; i++) {
+		start = now_ns();
+		put_sync(ctx, msg);
+		ret = ctx_send(ctx, msg, sizeof(msg), NULL, 0);
+		if (!ret)
+			ret = ctx_wait_done(ctx, msg[2], NULL);
+		if (ret < 0)
+			return ret;
+		w->lat_ns[w->samples++] = now_ns() - start;
+		w->msgs++;
+		w->bytes += sizeof(msg);
+	}
+
+	return 0;
+}
+
+/*
+ * Sends opts.size bytes per message, each ending in a sync so that its
+ * completion can be timed, with up to opts.window messages in flight.
+ */
+static int run_stream(struct worker *w, int alloc_fd)
+{
+	struct ctx *ctx = &w->ctx;
+	unsigned int words = opts.size / 4;
+	uint64_t *sent_ns;
+	uint32_t *ids;
+	uint32_t *msg;
+	unsigned long sent, done;
+	unsigned int i;
+	long ret = 0;
+
+	msg = malloc(words * 4);
+	sent_ns = calloc(opts.window, sizeof(*sent_ns));
+	ids = calloc(opts.window, sizeof(*ids));
+	if (!msg || !sent_ns || !ids) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (sent = done = 0; done < opts.iters;) {
+		while (sent < opts.iters && sent - done < opts.window) {
+			i = 0;
+			if (alloc_fd >= 0) {
+				/* wl_shm.create_pool(id, fd, size), then destroy */
+				msg[i++] = 4;
+				msg[i++] = 16 << 16 | WL_SHM_CREATE_POOL;
+				msg[i++] = ctx->next_id;
+				msg[i++] = opts.size;
+				msg[i++] = ctx->next_id++;
+				msg[i++] = 8 << 16 | WL_SHM_POOL_DESTROY;
+			}
+			for (; i + 6 <= words; i += 3)
+				put_sync(ctx, &msg[i]);
+			ids[sent % opts.window] = put_sync(ctx, &msg[i]);
+			i += 3;
+
+			sent_ns[sent % opts.window] = now_ns();
+			ret = ctx_send(ctx, msg, i * 4, &alloc_fd,
+				       alloc_fd >= 0 ? 1 : 0);
+			if (ret)
+				goto out;
+			w->bytes += i * 4;
+			sent++;
+		}
+
+		ret = ctx_wait_done(ctx, ids[done % opts.window], NULL);
+		if (ret < 0)
+			goto out;
+		w->lat_ns[w->samples++] = now_ns() - sent_ns[done % opts.window];
+		w->msgs++;
+		done++;
+	}
+	ret = 0;
+
+out:
+	free(ids);
+	free(sent_ns);
+	free(msg);
+	return ret;
+}
+
+static int run_alloc(struct worker *w, int map)
+{
+	unsigned long i;
+	uint64_t start;
+	void *addr;
+	int fd;
+
+	for (i = 0; i < opts.iters; i++) {
+		start = now_ns();
+		fd = new_alloc(w->ctx.wl_fd, opts.size);
+		if (fd < 0)
+			return fd;
+		if (map) {
+			addr = mmap(NULL, opts.size, PROT_READ | PROT_WRITE,
+				    MAP_SHARED, fd, 0);
+			if (addr == MAP_FAILED) {
+				close(fd);
+				return -errno;
+			}
+			memset(addr, i, opts.size);
+			munmap(addr, opts.size);
+			w->bytes += opts.size;
+		}
+		close(fd);
+		w->lat_ns[w->samples++] = now_ns() - start;
+		w->msgs++;
+	}
+
+	return 0;
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	int alloc_fd = -1;
+	int ret;
+
+	switch (opts.mode) {
+	case MODE_ALLOC:
+	case MODE_MMAP:
+		ret = run_alloc(w, opts.mode == MODE_MMAP);
+		break;
+	case MODE_STREAMFD:
+		ret = ctx_bind_shm(&w->ctx);
+		if (ret)
+			break;
+		alloc_fd = new_alloc(w->ctx.wl_fd, opts.size);
+		if (alloc_fd < 0) {
+			ret = alloc_fd;
+			break;
+		}
+		/* fall through */
+	case MODE_STREAM:
+		ret = run_stream(w, alloc_fd);
+		break;
+	default:
+		ret = run_pingpong(w);
+		break;
+	}
+
+	if (alloc_fd >= 0)
+		close(alloc_fd);
+	w->err = ret;
+	return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static uint64_t percentile(const uint64_t *sorted, unsigned long count,
+			   unsigned int pct)
+{
+	unsigned long i = count * pct / 100;
+
+	return count ? sorted[i < count ? i : count - 1] : 0;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-m pingpong|stream|streamfd|alloc|mmap]\n"
+		"          [-c contexts] [-n iterations] [-s size] [-w window] [-a]\n"
+		"  -s  bytes per stream message or per allocation (default 4096)\n"
+		"  -w  stream messages in flight per context (default 8)\n"
+		"  -a  open contexts with VIRTWL_IOCTL_NEW_CTX_ASYNC_SEND\n",
+		argv0);
+	exit(2);
+}
+
+static void parse_args(int argc, char **argv)
+{
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:m:c:n:s:w:a")) != -1) {
+		switch (opt) {
+		case 'd':
+			opts.dev = optarg;
+			break;
+		case 'm':
+			for (i = 0; i <= MODE_MMAP; i++)
+				if (!strcmp(optarg, mode_names[i]))
+					break;
+			if (i > MODE_MMAP)
+				usage(argv[0]);
+			opts.mode = i;
+			break;
+		case 'c':
+			opts.contexts = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.iters = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			opts.size = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			opts.window = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			opts.ctx_flags |= VIRTWL_IOCTL_NEW_CTX_ASYNC_SEND;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!opts.contexts || !opts.iters || !opts.window || !opts.size)
+		usage(argv[0]);
+	/* a stream message is at least one sync, plus the pool requests */
+	if (opts.mode == MODE_STREAM || opts.mode == MODE_STREAMFD) {
+		opts.size &= ~3u;
+		if (opts.size < (opts.mode == MODE_STREAMFD ? 36 : 12) ||
+		    opts.size > RECV_SIZE)
+			usage(argv[0]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	uint64_t *all_ns;
+	uint64_t start, elapsed, msgs = 0, bytes = 0;
+	unsigned long count = 0;
+	unsigned int i;
+	int wl_fd;
+	int ret = 0;
+
+	parse_args(argc, argv);
+
+	wl_fd = open(opts.dev, O_RDWR | O_CLOEXEC);
+	if (wl_fd < 0) {
+		perror(opts.dev);
+		return 1;
+	}
+
+	workers = calloc(opts.contexts, sizeof(*workers));
+	all_ns = calloc(opts.contexts * opts.iters, sizeof(*all_ns));
+	if (!workers || !all_ns) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < opts.contexts; i++) {
+		workers[i].index = i;
+		workers[i].lat_ns = all_ns + i * opts.iters;
+		workers[i].ctx.wl_fd = wl_fd;
+		if (opts.mode == MODE_ALLOC || opts.mode == MODE_MMAP)
+			continue;
+		ret = new_ctx(&workers[i].ctx, wl_fd);
+		if (ret) {
+			fprintf(stderr, "failed to create context %u: %s\n", i,
+				strerror(-ret));
+			return 1;
+		}
+	}
+
+	start = now_ns();
+	for (i = 0; i < opts.contexts; i++)
+		if (pthread_create(&workers[i].thread, NULL, worker_main,
+				   &workers[i])) {
+			fprintf(stderr, "failed to start thread %u\n", i);
+			return 1;
+		}
+	for (i = 0; i < opts.contexts; i++)
+		pthread_join(workers[i].thread, NULL);
+	elapsed = now_ns() - start;
+
+	/* samples are contiguous per worker, gather them before sorting */
+	for (i = 0; i < opts.contexts; i++) {
+		struct worker *w = &workers[i];
+
+		if (w->err) {
+			fprintf(stderr, "context %u failed after %lu: %s\n", i,
+				w->samples, strerror(-w->err));
+			ret = 1;
+		}
+		memmove(all_ns + count, w->lat_ns, w->samples * sizeof(*all_ns));
+		count += w->samples;
+		msgs += w->msgs;
+		bytes += w->bytes;
+		if (w->ctx.fd > 0)
+			close(w->ctx.fd);
+	}
+	qsort(all_ns, count, sizeof(*all_ns), cmp_u64);
+
+	printf("mode %s contexts %u iterations %lu size %u window %u%s\n",
+	       mode_names[opts.mode], opts.contexts, opts.iters, opts.size,
+	       opts.window, opts.ctx_flags ? " async" : "");
+	printf("ops %llu in %.3f s: %.0f ops/s %.2f MB/s\n",
+	       (unsigned long long)msgs, elapsed / 1e9, msgs * 1e9 / elapsed,
+	       bytes * 1e3 / elapsed);
+	printf("latency us: p50 %.1f p99 %.1f max %.1f\n",
+	       percentile(all_ns, count, 50) / 1e3,
+	       percentile(all_ns, count, 99) / 1e3,
+	       count ? all_ns[count - 1] / 1e3 : 0.0);
+
+	free(all_ns);
+	free(workers);
+	close(wl_fd);
+	return ret;
+}
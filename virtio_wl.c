@@ -38,56 +38,268 @@ expose a unix stream socket from this driver, the user space helper is much
 cleaner to write.
 */
 
+#include <linux/aio.h>
 #include <linux/anon_inodes.h>
 #include <linux/cdev.h>
+#include <linux/debugfs.h>
 #include <linux/compat.h>
 #include <linux/completion.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-mapping.h>
 #include <linux/err.h>
 #include <linux/fdtable.h>
 #include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/hashtable.h>
 #include <linux/idr.h>
+#include <linux/io.h>
 #include <linux/kfifo.h>
+#include <linux/mm.h>
+#include <linux/mmu_context.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/pfn.h>
+#include <linux/kref.h>
+#include <linux/ktime.h>
 #include <linux/poll.h>
+#include <linux/rcupdate.h>
 #include <linux/scatterlist.h>
+#include <linux/seq_file.h>
+#include <linux/shrinker.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
 #include <linux/syscalls.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/virtio.h>
+#include <linux/workqueue.h>
 #include "virtio_wl.h"
 
+#define CREATE_TRACE_POINTS
+#include "virtio_wl_trace.h"
+
 #define VFD_ILLEGAL_SIGN_BIT 0x80000000
 #define VFD_HOST_VFD_ID_BIT 0x40000000
 
+/* number of VIRTWL_OUT_BUFFER_SIZE command buffers kept per device */
+#define VIRTWL_CMD_POOL_SIZE 64
+
+/* most vfds closed by one VIRTIO_WL_CMD_VFD_CLOSE_BATCH */
+#define VIRTWL_CLOSE_BATCH_MAX 256
+
+/* number of entries a vfd's in_ring starts with, it doubles when full */
+#define VIRTWL_IN_RING_MIN 16
+
+/* extents that fit in one VIRTIO_WL_CMD_VFD_IMPORT */
+#define VIRTWL_IMPORT_EXTENTS_MAX \
+	((VIRTWL_OUT_BUFFER_SIZE - sizeof(struct virtio_wl_ctrl_vfd_import)) / \
+	 sizeof(struct virtio_wl_vfd_extent))
+
+/* host vfds kept allocated per qp for the offers of the next in vq pass */
+#define VIRTWL_HOST_VFD_POOL_SIZE 16
+#define VIRTWL_OFFERS_HASH_BITS 5
+
 struct virtwl_vfd_qentry {
-	struct list_head list;
 	struct virtio_wl_ctrl_hdr *hdr;
 	unsigned int len; /* total byte length of ctrl_vfd_* + vfds + data */
-	unsigned int vfd_offset; /* int offset into vfds */
+	unsigned int vfd_offset; /* offset into vfds */
 	unsigned int data_offset; /* byte offset into data */
+	/* owner of the in vq that hdr came from, NULL if hdr is a kmalloc copy */
+	struct virtwl_vq_pair *qp;
+	/* references to the received vfds, resolved when the entry is queued */
+	struct virtwl_vfd **vfds;
+	unsigned int vfd_count;
+};
+
+enum virtwl_stat {
+	VIRTWL_STAT_MSGS_SENT,
+	VIRTWL_STAT_BYTES_SENT,
+	VIRTWL_STAT_VFDS_SENT,
+	VIRTWL_STAT_MSGS_RECV,
+	VIRTWL_STAT_BYTES_RECV,
+	VIRTWL_STAT_VFDS_RECV,
+	VIRTWL_STAT_UNKNOWN_VFDS, /* recvs for or carrying ids not in vfds */
+	VIRTWL_STAT_QUEUE_FULL, /* adds that found the out vq full */
+	VIRTWL_STAT_CTXS,
+	VIRTWL_STAT_ALLOCS,
+	VIRTWL_STAT_ALLOC_NS, /* sum over allocs of the host round trip */
+	VIRTWL_STAT_ALLOC_CACHE_HITS,
+	VIRTWL_STAT_CLOSES,
+	VIRTWL_STAT_CLOSE_CMDS,
+	VIRTWL_STAT_CLOSE_NS, /* sum over close cmds of the host round trip */
+	VIRTWL_STAT_COUNT,
 };
 
+/* send latencies in buckets of [2^(i-1), 2^i) usecs, the last is open ended */
+#define VIRTWL_LAT_BUCKETS 24
+
+/* Per cpu, so that counting never contends; readers sum over all cpus. */
+struct virtwl_stats {
+	u64 v[VIRTWL_STAT_COUNT];
+	u64 send_lat[VIRTWL_LAT_BUCKETS];
+};
+
+/*
+ * A vfd is referenced by its id in vi->vfds until it's closed, which drops
+ * the initial reference. Host vfds other than contexts are kept out of
+ * vi->vfds, see vq_handle_new(). Lookups in vi->vfds are done under RCU and
+ * must take their own reference with virtwl_vfd_find().
+ */
 struct virtwl_vfd {
-	struct kobject kobj;
+	struct kref refcount;
+	struct rcu_head rcu;
 	struct mutex lock;
+	bool dead; /* closed, may still be referenced but won't queue data */
 
 	struct virtwl_info *vi;
+	struct virtwl_vq_pair *qp; /* carries this vfd's sends and close */
 	uint32_t id;
 	uint32_t flags;
 	uint64_t pfn;
 	uint32_t size;
+	uint32_t caching; /* VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK bits */
+	bool huge; /* created with VIRTWL_IOCTL_NEW_ALLOC_HUGE */
+
+	/* sent to the host at least once, so it must never be recycled */
+	bool shared;
+	/* in vi->alloc_cache while closed but kept for reuse */
+	struct hlist_node cache_node;
+	struct list_head cache_lru;
+	/* in vi->close_pending, then in the virtwl_close that closes it */
+	struct list_head close_node;
+	/* host vfds only: in qp->host_vfd_pool, then in qp->offers */
+	struct hlist_node offer_node;
+	/* host vfds not in vi->vfds only: in qp->host_vfds until removed */
+	struct list_head host_node;
+	/* imported dma-bufs only, held until the host has closed the vfd */
+	struct dma_buf_attachment *import_attach;
+	struct sg_table *import_sgt;
 
-	struct list_head in_queue; /* list of virtwl_vfd_qentry */
+	/*
+	 * Received messages, oldest at in_tail. Indices run freely and are
+	 * masked by the power of two in_ring_size. Entries before in_data have
+	 * no data left and entries before in_vfds have no vfds left; an entry
+	 * is retired once it is before both.
+	 */
+	struct virtwl_vfd_qentry *in_ring;
+	unsigned int in_ring_size;
+	unsigned int in_head;
+	unsigned int in_tail;
+	unsigned int in_data;
+	unsigned int in_vfds;
+	unsigned int in_held_bufs; /* entries still holding an in vq buffer */
+	size_t in_held_bytes; /* message bytes in those buffers */
+	size_t in_copied_bytes; /* message bytes in entries copied out of them */
 	wait_queue_head_t in_waitq;
+	/* pollers for POLLOUT and POLLERR, on qp->out_blocked while waiting */
+	wait_queue_head_t out_waitq;
+	struct list_head out_blocked_node;
+
+	/* AIO reads waiting for data, and cancelled ones to be completed */
+	spinlock_t aio_lock; /* irq safe, taken under the aio core's ctx_lock */
+	struct list_head aio_reads;
+	struct list_head aio_cancelled;
+	struct work_struct aio_work;
+
+	struct virtwl_ring *ring; /* set once by VIRTWL_IOCTL_RING_SETUP */
+	/* a recv or read was made, which the cq would hide messages from */
+	bool cq_disabled; /* under lock */
+	struct virtwl_stats __percpu *stats; /* of a context, may be NULL */
+
+	bool async_send; /* VIRTWL_IOCTL_NEW_CTX_ASYNC_SEND */
+	atomic_t sends_in_flight;
+	int send_err; /* first failure of an async send, reported on next send */
 };
 
-struct virtwl_info {
-	dev_t dev_num;
-	struct device *dev;
-	struct class *class;
-	struct cdev cdev;
+/*
+ * Token for every buffer queued on the out vq. Synchronous callers wait on
+ * finish_completion. Asynchronous callers set finish instead, which is called
+ * from vq_out_work_handler once the host has returned the buffer.
+ */
+struct virtwl_out_req {
+	struct completion finish_completion;
+	void (*finish)(struct virtwl_out_req *req);
+	/* recorded by vq_add_out_locked for tracing and latency stats */
+	u32 type;
+	u32 vfd_id;
+	u64 queued_ns;
+	struct virtio_wl_ctrl_hdr *resp;
+};
+
+struct virtwl_send {
+	struct virtwl_out_req req;
+	struct virtwl_vfd *vfd;
+	size_t alloc_size; /* for virtwl_cmd_free */
+	struct scatterlist *sgs[3];
+	unsigned int out_sgs;
+	struct scatterlist out_sg;
+	struct scatterlist in_sg;
+	/* pinned payload of a zero-copy send, otherwise it follows the ids */
+	struct page **pages;
+	int nr_pages;
+	struct sg_table data_sgt;
+	/* an AIO write, completed by vfd_aio_send_finish */
+	struct kiocb *iocb;
+	size_t len;
+	/*
+	 * References on the sent vfds, held until the host is done with the
+	 * send. Otherwise a close of one of them, which may be on another
+	 * queue pair, could reach the host first.
+	 */
+	struct file *vfd_files[VIRTWL_SEND_MAX_ALLOCS];
+	struct virtio_wl_ctrl_vfd_send ctrl_send; /* followed by ids and data */
+};
 
+#define VIRTWL_RING_SLOT_DATA_MAX (PAGE_SIZE - sizeof(struct virtwl_ring_slot))
+
+/*
+ * The pages behind the struct virtwl_ring_hdr mapping of a context. The driver
+ * keeps its own copy of every index and only checks those the user writes, so
+ * a user scribbling over the header can only confuse itself.
+ */
+struct virtwl_ring {
+	struct virtwl_ring_hdr *hdr;
+	void **pages; /* hdr, then the sq slots, then the cq slots */
+	unsigned int nr_pages;
+	u32 slot_count;
+
+	struct mutex kick_lock;
+	u32 sq_next; /* next sq slot to send, under kick_lock */
+	spinlock_t sq_lock; /* for sq_head and sq_done */
+	u32 sq_head;
+	unsigned long *sq_done; /* sent slots the host is done with */
+
+	u32 cq_tail; /* under the vfd's lock */
+};
+
+/* A VIRTIO_WL_CMD_VFD_SEND whose payload stays in an sq slot. */
+struct virtwl_ring_send {
+	struct virtwl_out_req req;
+	struct virtwl_vfd *vfd;
+	u32 slot;
+	struct scatterlist out_sg;
+	struct scatterlist data_sg;
+	struct scatterlist in_sg;
+	struct scatterlist *sgs[3];
+	struct virtio_wl_ctrl_vfd_send ctrl_send;
+};
+
+/* An AIO read on a context, completed by vfd_aio_work_handler. */
+struct virtwl_aio_read {
+	struct list_head node; /* in aio_reads or aio_cancelled of the vfd */
+	struct kiocb *iocb;
+	struct iov_iter to;
+	const void *iov; /* copy of the iovec array behind to, from dup_iter */
+	/* kept alive by the aio context, which is torn down before the mm */
+	struct mm_struct *mm;
+	ssize_t ret;
+};
+
+/* An in and out virtqueue, so that busy contexts don't delay each other. */
+struct virtwl_vq_pair {
+	struct virtwl_info *vi;
 	struct mutex vq_locks[VIRTWL_QUEUE_COUNT];
 	struct virtqueue *vqs[VIRTWL_QUEUE_COUNT];
 	struct work_struct in_vq_work;
@@ -95,15 +307,308 @@ struct virtwl_info {
 
 	wait_queue_head_t out_waitq;
 
-	struct mutex vfds_lock;
+	/*
+	 * num_free of the out vq as of the last add or reap, for poll to read
+	 * without the vq lock. Contexts that polled while it was 0 are on
+	 * out_blocked and are woken once it isn't.
+	 */
+	unsigned int out_free;
+	/* synchronous requests on the out vq, under its lock */
+	unsigned int out_waiters;
+	spinlock_t out_blocked_lock;
+	struct list_head out_blocked;
+
+	/*
+	 * Only used by in_vq_work, so neither needs a lock. A vfd the host
+	 * offers comes from host_vfd_pool, which is refilled after each pass,
+	 * and waits in offers for the recv that carries it. Only the in vq
+	 * orders a VFD_NEW before the VFD_RECV that refers to it, so both are
+	 * always on the same qp.
+	 */
+	struct hlist_head host_vfd_pool;
+	unsigned int host_vfd_pool_count;
+	DECLARE_HASHTABLE(offers, VIRTWL_OFFERS_HASH_BITS);
+
+	/* host vfds that aren't in vi->vfds, so a restore can name them */
+	spinlock_t host_vfds_lock;
+	struct list_head host_vfds;
+
+	/*
+	 * Under the in vq lock. While the device is frozen there are no vqs,
+	 * and in buffers given back are kept in in_saved, each linked to the
+	 * next by its first word, to go back into the in vq on restore.
+	 */
+	bool frozen;
+	void *in_saved;
+
+	char vq_names[VIRTWL_QUEUE_COUNT][16];
+};
+
+/*
+ * A close command queued without waiting, for one vfd or a batch of them. The
+ * vfds are removed in vfd_close_finish once the host has closed them.
+ */
+struct virtwl_close {
+	struct virtwl_out_req req;
+	struct virtwl_info *vi;
+	size_t alloc_size; /* for virtwl_cmd_free */
+	struct list_head vfds; /* linked by close_node */
+	u64 start_ns;
+	struct scatterlist out_sg;
+	struct scatterlist in_sg;
+	struct scatterlist *sgs[2];
+	/* followed by virtio_wl_ctrl_vfd or virtio_wl_ctrl_vfd_close_batch */
+};
+
+/* One VIRTIO_WL_CMD_VFD_RESTORE, queued with the others of a restore. */
+struct virtwl_restore {
+	struct virtwl_out_req req;
+	struct virtwl_vfd *vfd; /* a reference, NULL for the end of the list */
+	int ret;
+	struct virtio_wl_ctrl_vfd_restore ctrl;
+	struct scatterlist out_sg;
+	struct scatterlist in_sg;
+	struct scatterlist *sgs[2];
+};
+
+struct virtwl_info {
+	struct virtio_device *vdev;
+	dev_t dev_num;
+	struct device *dev;
+	struct class *class;
+	struct cdev cdev;
+
+	struct workqueue_struct *wq; /* runs the vq work of every qp */
+	struct virtwl_vq_pair *qps;
+	unsigned int qp_count;
+	atomic_t next_qp; /* for spreading new contexts over qps */
+
+	size_t in_buf_size; /* bytes in each buffer given to the in vq */
+	unsigned int in_buf_count; /* number of buffers given to the in vq */
+
+	/* messages copied out of in vq buffers because a vfd was over limits */
+	atomic_long_t in_overflow_msgs;
+	atomic_long_t in_overflow_bytes;
+	/* messages dropped because a vfd's copies were over vfd_in_copy_limit */
+	atomic_long_t in_dropped_msgs;
+
+	/* Closed allocations kept open on the host for reuse, hashed by size. */
+	struct mutex alloc_cache_lock;
+	DECLARE_HASHTABLE(alloc_cache, 6);
+	struct list_head alloc_cache_lru; /* oldest first */
+	unsigned int alloc_cache_count;
+	struct shrinker alloc_cache_shrinker;
+
+	/* released vfds waiting for close_work to close them on the host */
+	spinlock_t close_lock;
+	struct list_head close_pending;
+	struct delayed_work close_work;
+	atomic_t closes_in_flight;
+	wait_queue_head_t close_waitq;
+
+	struct virtwl_stats __percpu *stats;
+	struct dentry *debugfs;
+
+	struct mutex vfds_lock; /* for changes to vfds, lookups use RCU */
 	struct idr vfds;
+	u32 max_vfd_id; /* guest vfd ids are below this */
+
+	/*
+	 * Free command buffers of VIRTWL_OUT_BUFFER_SIZE bytes, preallocated so
+	 * that small sends, news and closes don't go to the allocator.
+	 */
+	spinlock_t cmd_pool_lock;
+	struct list_head cmd_pool;
+	unsigned int cmd_pool_count;
 };
 
+static unsigned int send_zerocopy_threshold = 16384;
+module_param(send_zerocopy_threshold, uint, 0644);
+MODULE_PARM_DESC(send_zerocopy_threshold,
+		 "Pin the user buffer instead of copying it for synchronous sends of at least this many bytes (0 to disable)");
+
+static unsigned int in_buffer_size = VIRTWL_IN_BUFFER_SIZE;
+module_param(in_buffer_size, uint, 0444);
+MODULE_PARM_DESC(in_buffer_size,
+		 "Size in bytes of each buffer the host writes messages into (4096 to 1M)");
+
+static unsigned int in_buffer_count;
+module_param(in_buffer_count, uint, 0444);
+MODULE_PARM_DESC(in_buffer_count,
+		 "Number of receive buffers given to the host per in queue (0 to fill the in queue with up to 4M of buffers)");
+
+static unsigned int vfd_in_buffer_limit = 32;
+module_param(vfd_in_buffer_limit, uint, 0644);
+MODULE_PARM_DESC(vfd_in_buffer_limit,
+		 "In vq buffers one vfd may hold before its messages are copied out (0 for no limit)");
+
+static unsigned int vfd_in_byte_limit = 128 * 1024;
+module_param(vfd_in_byte_limit, uint, 0644);
+MODULE_PARM_DESC(vfd_in_byte_limit,
+		 "Message bytes one vfd may hold in in vq buffers before its messages are copied out (0 for no limit)");
+
+static unsigned int vfd_in_copy_limit = 16 << 20;
+module_param(vfd_in_copy_limit, uint, 0644);
+MODULE_PARM_DESC(vfd_in_copy_limit,
+		 "Message bytes one vfd may hold in copies before further messages are dropped (0 for no limit)");
+
+static unsigned int alloc_cache_size;
+module_param(alloc_cache_size, uint, 0644);
+MODULE_PARM_DESC(alloc_cache_size,
+		 "Closed allocations kept for reuse by new allocations of the same size (0 to disable)");
+
+static unsigned int close_delay_usecs;
+module_param(close_delay_usecs, uint, 0644);
+MODULE_PARM_DESC(close_delay_usecs,
+		 "Microseconds a released vfd waits to share a close command with others");
+
+static unsigned int max_queue_pairs;
+module_param(max_queue_pairs, uint, 0444);
+MODULE_PARM_DESC(max_queue_pairs,
+		 "Limit on the in/out queue pairs used if the device offers several (0 for one per online CPU)");
+
+static bool workqueue_unbound;
+module_param(workqueue_unbound, bool, 0444);
+MODULE_PARM_DESC(workqueue_unbound,
+		 "Run vq work on any CPU instead of the CPU that took the interrupt");
+
+static unsigned int in_budget = 64;
+module_param(in_budget, uint, 0644);
+MODULE_PARM_DESC(in_budget,
+		 "Messages handled per run of the in vq work before yielding the CPU (0 for no limit)");
+
+static unsigned int send_poll_usecs;
+module_param(send_poll_usecs, uint, 0644);
+MODULE_PARM_DESC(send_poll_usecs,
+		 "Microseconds a synchronous send polls the out vq before sleeping (0 to disable)");
+
 static struct virtwl_vfd *virtwl_vfd_alloc(struct virtwl_info *vi);
-static void virtwl_vfd_free(struct virtwl_vfd *vfd);
+static struct virtwl_vfd *virtwl_vfd_find(struct virtwl_info *vi, u32 id);
+static void virtwl_vfd_put(struct virtwl_vfd *vfd);
+static void virtwl_vfd_remove(struct virtwl_vfd *vfd);
+static void vfd_aio_work_handler(struct work_struct *work);
 
 static struct file_operations virtwl_vfd_fops;
 
+/* Counts n towards stat of the device and, if it's a context, of vfd. */
+static void virtwl_stat_add(struct virtwl_info *vi, struct virtwl_vfd *vfd,
+			    enum virtwl_stat stat, u64 n)
+{
+	this_cpu_add(vi->stats->v[stat], n);
+	if (vfd && vfd->stats)
+		this_cpu_add(vfd->stats->v[stat], n);
+}
+
+static void virtwl_stats_sum(struct virtwl_stats __percpu *stats,
+			     struct virtwl_stats *sum)
+{
+	unsigned int i;
+	int cpu;
+
+	memset(sum, 0, sizeof(*sum));
+	for_each_possible_cpu(cpu) {
+		struct virtwl_stats *cpu_stats = per_cpu_ptr(stats, cpu);
+
+		for (i = 0; i < VIRTWL_STAT_COUNT; i++)
+			sum->v[i] += READ_ONCE(cpu_stats->v[i]);
+		for (i = 0; i < VIRTWL_LAT_BUCKETS; i++)
+			sum->send_lat[i] += READ_ONCE(cpu_stats->send_lat[i]);
+	}
+}
+
+static void virtwl_stat_send_latency(struct virtwl_info *vi, u64 latency_ns)
+{
+	unsigned int bucket = min_t(unsigned int,
+				    fls64(div_u64(latency_ns, NSEC_PER_USEC)),
+				    VIRTWL_LAT_BUCKETS - 1);
+
+	this_cpu_inc(vi->stats->send_lat[bucket]);
+}
+
+static unsigned int qp_index(struct virtwl_vq_pair *qp)
+{
+	return qp - qp->vi->qps;
+}
+
+static void vq_kick(struct virtwl_vq_pair *qp, unsigned int which)
+{
+	/* only buffers given back can race with a freeze, see in_saved */
+	if (READ_ONCE(qp->frozen))
+		return;
+
+	trace_virtwl_vq_kick(qp_index(qp), which);
+	virtqueue_kick(qp->vqs[which]);
+}
+
+/*
+ * Returns a zeroed buffer of size bytes for a command sent to the host. Buffers
+ * that fit in VIRTWL_OUT_BUFFER_SIZE come from the device's pool when possible.
+ */
+static void *virtwl_cmd_alloc(struct virtwl_info *vi, size_t size)
+{
+	void *buffer = NULL;
+
+	if (size > VIRTWL_OUT_BUFFER_SIZE)
+		return kzalloc(size, GFP_KERNEL);
+
+	spin_lock(&vi->cmd_pool_lock);
+	if (!list_empty(&vi->cmd_pool)) {
+		buffer = vi->cmd_pool.next;
+		list_del(buffer);
+		vi->cmd_pool_count--;
+	}
+	spin_unlock(&vi->cmd_pool_lock);
+
+	/* allocate full size so that the buffer can join the pool when freed */
+	if (!buffer)
+		return kzalloc(VIRTWL_OUT_BUFFER_SIZE, GFP_KERNEL);
+
+	memset(buffer, 0, size);
+	return buffer;
+}
+
+/* size must be the size that buffer was allocated with */
+static void virtwl_cmd_free(struct virtwl_info *vi, void *buffer, size_t size)
+{
+	if (!buffer)
+		return;
+
+	if (size <= VIRTWL_OUT_BUFFER_SIZE) {
+		spin_lock(&vi->cmd_pool_lock);
+		if (vi->cmd_pool_count < VIRTWL_CMD_POOL_SIZE) {
+			list_add(buffer, &vi->cmd_pool);
+			vi->cmd_pool_count++;
+			buffer = NULL;
+		}
+		spin_unlock(&vi->cmd_pool_lock);
+	}
+
+	kfree(buffer);
+}
+
+static void virtwl_cmd_pool_fill(struct virtwl_info *vi)
+{
+	void *buffer;
+
+	while (vi->cmd_pool_count < VIRTWL_CMD_POOL_SIZE) {
+		buffer = kmalloc(VIRTWL_OUT_BUFFER_SIZE, GFP_KERNEL);
+		if (!buffer)
+			break;
+		list_add(buffer, &vi->cmd_pool);
+		vi->cmd_pool_count++;
+	}
+}
+
+static void virtwl_cmd_pool_drain(struct virtwl_info *vi)
+{
+	struct list_head *buffer, *next;
+
+	list_for_each_safe(buffer, next, &vi->cmd_pool)
+		kfree(buffer);
+	INIT_LIST_HEAD(&vi->cmd_pool);
+	vi->cmd_pool_count = 0;
+}
+
 static int virtwl_resp_err(unsigned int type)
 {
 	switch (type) {
@@ -121,13 +626,22 @@ static int virtwl_resp_err(unsigned int type)
 	}
 }
 
-static int vq_return_inbuf_locked(struct virtqueue *vq, void *buffer)
+static int vq_return_inbuf_locked(struct virtwl_vq_pair *qp, void *buffer)
 {
+	struct virtwl_info *vi = qp->vi;
 	int ret;
 	struct scatterlist sg[1];
-	sg_init_one(sg, buffer, PAGE_SIZE);
 
-	ret = virtqueue_add_inbuf(vq, sg, 1, buffer, GFP_KERNEL);
+	if (qp->frozen) {
+		*(void **)buffer = qp->in_saved;
+		qp->in_saved = buffer;
+		return 0;
+	}
+
+	sg_init_one(sg, buffer, vi->in_buf_size);
+
+	ret = virtqueue_add_inbuf(qp->vqs[VIRTWL_VQ_IN], sg, 1, buffer,
+				  GFP_KERNEL);
 	if (ret) {
 		printk("virtwl: failed to give inbuf to host: %d\n", ret);
 		return ret;
@@ -136,685 +650,2676 @@ static int vq_return_inbuf_locked(struct virtqueue *vq, void *buffer)
 	return 0;
 }
 
-static int vq_queue_out(struct virtwl_info *vi, struct scatterlist *out_sg,
-			struct scatterlist *in_sg,
-			struct completion *finish_completion,
-			bool nonblock)
+static void virtwl_out_req_init(struct virtwl_out_req *req,
+				void (*finish)(struct virtwl_out_req *req))
 {
-	struct virtqueue *vq = vi->vqs[VIRTWL_VQ_OUT];
-	struct mutex *vq_lock = &vi->vq_locks[VIRTWL_VQ_OUT];
-	struct scatterlist *sgs[] = { out_sg, in_sg };
-	int ret = 0;
+	init_completion(&req->finish_completion);
+	req->finish = finish;
+}
 
-	mutex_lock(vq_lock);
-	while ((ret = virtqueue_add_sgs(vq, sgs, 1, 1, finish_completion,
-				        GFP_KERNEL)) == -ENOSPC) {
+/*
+ * Adds a request to the out vq without kicking it. If the vq is full, anything
+ * added so far is kicked and vq_lock is dropped while waiting for the host to
+ * free a descriptor, so this always returns with vq_lock held.
+ */
+static int vq_add_out_locked(struct virtwl_vq_pair *qp,
+			     struct scatterlist **sgs, unsigned int out_sgs,
+			     unsigned int in_sgs, struct virtwl_out_req *req,
+			     bool nonblock)
+{
+	struct virtqueue *vq = qp->vqs[VIRTWL_VQ_OUT];
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_OUT];
+	/* every out command starts with the header and a vfd id or count */
+	struct virtio_wl_ctrl_vfd *ctrl = sg_virt(sgs[0]);
+	int ret;
+
+	/* a freeze waits for the vqs to drain and userspace can't send */
+	if (READ_ONCE(qp->frozen))
+		return -EBUSY;
+
+	req->type = ctrl->hdr.type;
+	req->vfd_id = ctrl->vfd_id;
+	req->resp = sg_virt(sgs[out_sgs]);
+	req->queued_ns = ktime_get_ns();
+
+	while ((ret = virtqueue_add_sgs(vq, sgs, out_sgs, in_sgs, req,
+					GFP_KERNEL)) == -ENOSPC) {
+		WRITE_ONCE(qp->out_free, 0);
+		virtwl_stat_add(qp->vi, NULL, VIRTWL_STAT_QUEUE_FULL, 1);
+		if (nonblock) {
+			ret = -EAGAIN;
+			break;
+		}
+		vq_kick(qp, VIRTWL_VQ_OUT);
 		mutex_unlock(vq_lock);
-		if (nonblock)
-			return -EAGAIN;
-		if (!wait_event_timeout(vi->out_waitq, vq->num_free > 0, HZ))
-			return -EBUSY;
+		ret = wait_event_timeout(qp->out_waitq, vq->num_free > 0, HZ);
 		mutex_lock(vq_lock);
+		if (!ret) {
+			ret = -EBUSY;
+			break;
+		}
+	}
+	if (!ret) {
+		WRITE_ONCE(qp->out_free, vq->num_free);
+		if (!req->finish)
+			qp->out_waiters++;
+	}
+
+	if (trace_virtwl_vq_add_enabled()) {
+		struct scatterlist *sg;
+		size_t bytes = 0;
+		unsigned int i;
+
+		for (i = 0; i < out_sgs; i++)
+			for (sg = sgs[i]; sg; sg = sg_next(sg))
+				bytes += sg->length;
+		trace_virtwl_vq_add(qp_index(qp), req->type, req->vfd_id,
+				    bytes, ret);
 	}
+
+	return ret;
+}
+
+static int vq_queue_out(struct virtwl_vq_pair *qp, struct scatterlist **sgs,
+			unsigned int out_sgs, unsigned int in_sgs,
+			struct virtwl_out_req *req, bool nonblock)
+{
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_OUT];
+	int ret;
+
+	mutex_lock(vq_lock);
+	ret = vq_add_out_locked(qp, sgs, out_sgs, in_sgs, req, nonblock);
 	if (!ret)
-		virtqueue_kick(vq);
+		vq_kick(qp, VIRTWL_VQ_OUT);
 	mutex_unlock(vq_lock);
 
 	return ret;
 }
 
-static int vq_fill_locked(struct virtqueue *vq)
+/*
+ * Gives the in vq up to in_buf_count buffers. Running out of memory part way
+ * only leaves the host fewer buffers, so this fails only if the vq has none.
+ */
+static int vq_fill_locked(struct virtwl_vq_pair *qp)
 {
+	struct virtwl_info *vi = qp->vi;
+	struct virtqueue *vq = qp->vqs[VIRTWL_VQ_IN];
+	unsigned int count = 0;
 	void *buffer;
 	int ret = 0;
 
-	while (vq->num_free > 0) {
-		buffer = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	while (vq->num_free > 0 && count < vi->in_buf_count) {
+		/* multi-page buffers are physically contiguous */
+		buffer = kmalloc(vi->in_buf_size, GFP_KERNEL | __GFP_NOWARN);
 		if (!buffer) {
 			ret = -ENOMEM;
-			goto clear_queue;
+			break;
 		}
 
-		ret = vq_return_inbuf_locked(vq, buffer);
-		if (ret)
-			goto clear_queue;
+		ret = vq_return_inbuf_locked(qp, buffer);
+		if (ret) {
+			kfree(buffer);
+			break;
+		}
+		count++;
 	}
 
-	return 0;
+	if (!ret)
+		return 0;
 
-clear_queue:
-	while ((buffer = virtqueue_detach_unused_buf(vq))) {
-		kfree(buffer);
-	}
+	printk("virtwl: gave the in vq only %u new buffers: %d\n", count, ret);
+	if (vq->num_free < virtqueue_get_vring_size(vq))
+		return 0;
 	return ret;
 }
 
-static bool vq_handle_new(struct virtwl_info *vi,
-			  struct virtio_wl_ctrl_vfd_new *new, unsigned int len)
+/* Frees the references to any vfds of a qentry not yet received. */
+static void vfd_qentry_free(struct virtwl_vfd_qentry *qentry)
 {
-	struct virtwl_vfd *vfd;
-	u32 id = new->vfd_id;
-	int ret;
-
-	if (id == 0)
-		return true; /* return the inbuf to vq */
-
-	if (!(id & VFD_HOST_VFD_ID_BIT) || (id & VFD_ILLEGAL_SIGN_BIT)) {
-		printk("virtwl: received a vfd with invalid id: %u\n", id);
-		return true; /* return the inbuf to vq */
-	}
-
-	vfd = virtwl_vfd_alloc(vi);
-	if (!vfd)
-		return true; /* return the inbuf to vq */
-
-	mutex_lock(&vi->vfds_lock);
-	ret = idr_alloc(&vi->vfds, vfd, id, id + 1, GFP_KERNEL);
-	mutex_unlock(&vi->vfds_lock);
+	while (qentry->vfd_offset < qentry->vfd_count)
+		virtwl_vfd_put(qentry->vfds[qentry->vfd_offset++]);
+	kfree(qentry->vfds);
+	qentry->vfds = NULL;
+}
 
-	if (ret <= 0) {
-		virtwl_vfd_free(vfd);
-		printk("virtwl: failed to place received vfd: %d\n", ret);
-		return true; /* return the inbuf to vq */
-	}
+static struct virtwl_vfd_qentry *vfd_qentry_at(struct virtwl_vfd *vfd,
+					       unsigned int index)
+{
+	return &vfd->in_ring[index & (vfd->in_ring_size - 1)];
+}
 
-	vfd->id = id;
-	vfd->size = new->size;
-	vfd->pfn = new->pfn;
-	vfd->flags = new->flags;
+static ssize_t vfd_qentry_data_len(struct virtwl_vfd_qentry *qentry)
+{
+	struct virtio_wl_ctrl_vfd_recv *recv =
+		(struct virtio_wl_ctrl_vfd_recv *)qentry->hdr;
 
-	return true; /* return the inbuf to vq */
+	return (ssize_t)qentry->len - (ssize_t)sizeof(*recv) -
+	       (ssize_t)recv->vfd_count * (ssize_t)sizeof(__le32);
 }
 
-static bool vq_handle_recv(struct virtwl_info *vi,
-			   struct virtio_wl_ctrl_vfd_recv *recv,
-			   unsigned int len)
+/* Must hold vfd->lock. */
+static bool vfd_in_pending(struct virtwl_vfd *vfd)
 {
-	struct virtwl_vfd *vfd;
-	struct virtwl_vfd_qentry *qentry;
-
-	mutex_lock(&vi->vfds_lock);
-	vfd = idr_find(&vi->vfds, recv->vfd_id);
-	if (vfd)
-		mutex_lock(&vfd->lock);
-	mutex_unlock(&vi->vfds_lock);
+	return vfd->in_head != vfd->in_tail;
+}
 
-	if (!vfd) {
-		printk("virtwl: recv for unknown vfd_id %u\n", recv->vfd_id);
-		return true; /* return the inbuf to vq */
-	}
+/* Must hold vfd->lock. Doubles in_ring, keeping entries and cursors. */
+static int vfd_in_ring_grow(struct virtwl_vfd *vfd)
+{
+	unsigned int size = vfd->in_ring_size ? vfd->in_ring_size * 2 :
+						VIRTWL_IN_RING_MIN;
+	unsigned int count = vfd->in_head - vfd->in_tail;
+	struct virtwl_vfd_qentry *ring;
+	unsigned int i;
+
+	ring = kmalloc_array(size, sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
 
-	qentry = kzalloc(sizeof(*qentry), GFP_KERNEL);
-	if (!qentry) {
-		mutex_unlock(&vfd->lock);
-		printk("virtwl: failed to allocate qentry for vfd\n");
-		return true; /* return the inbuf to vq */
-	}
+	for (i = 0; i < count; i++)
+		ring[i] = *vfd_qentry_at(vfd, vfd->in_tail + i);
 
-	qentry->hdr = &recv->hdr;
-	qentry->len = len;
+	vfd->in_data -= vfd->in_tail;
+	vfd->in_vfds -= vfd->in_tail;
+	vfd->in_head = count;
+	vfd->in_tail = 0;
+	kfree(vfd->in_ring);
+	vfd->in_ring = ring;
+	vfd->in_ring_size = size;
 
-	list_add_tail(&qentry->list, &vfd->in_queue);
-	wake_up_interruptible(&vfd->in_waitq);
-	mutex_unlock(&vfd->lock);
+	return 0;
+}
 
-	return false; /* no return the inbuf to vq */
+/*
+ * Must hold vfd->lock. Returns true if holding another in vq buffer of len
+ * bytes would put vfd over its limits, which keeps a vfd nobody reads from
+ * starving the in vq shared by every other vfd.
+ */
+static bool vfd_in_over_limit(struct virtwl_vfd *vfd, unsigned int len)
+{
+	unsigned int buffer_limit = READ_ONCE(vfd_in_buffer_limit);
+	unsigned int byte_limit = READ_ONCE(vfd_in_byte_limit);
+
+	if (buffer_limit && vfd->in_held_bufs >= buffer_limit)
+		return true;
+	if (byte_limit && vfd->in_held_bytes + len > byte_limit)
+		return true;
+	return false;
 }
 
-static bool vq_dispatch_hdr(struct virtwl_info *vi, unsigned int len,
-			    struct virtio_wl_ctrl_hdr *hdr)
+/*
+ * Must hold vfd->lock. Copies qentry to the head of in_ring. If the vfd is
+ * over its limits the message is first copied out of the in vq buffer, in
+ * which case qentry->qp is cleared and the caller must return the buffer.
+ * Fails with -ENOBUFS if the copies would go over vfd_in_copy_limit.
+ */
+static int vfd_in_push(struct virtwl_vfd *vfd,
+		       struct virtwl_vfd_qentry *qentry)
 {
-	struct virtqueue *vq = vi->vqs[VIRTWL_VQ_IN];
-	struct mutex *vq_lock = &vi->vq_locks[VIRTWL_VQ_IN];
-	bool return_vq = true;
+	struct virtwl_info *vi = vfd->vi;
+	struct virtio_wl_ctrl_hdr *copy;
 	int ret;
 
-	switch (hdr->type) {
-	case VIRTIO_WL_CMD_VFD_NEW:
-		return_vq = vq_handle_new(vi,
-					  (struct virtio_wl_ctrl_vfd_new *)hdr,
-					  len);
-		break;
-	case VIRTIO_WL_CMD_VFD_RECV:
-		return_vq = vq_handle_recv(vi,
-			(struct virtio_wl_ctrl_vfd_recv *)hdr, len);
-		break;
-	default:
-		printk("virtwl: unhandled ctrl command: %u\n", hdr->type);
-		break;
+	if (vfd->in_head - vfd->in_tail == vfd->in_ring_size) {
+		ret = vfd_in_ring_grow(vfd);
+		if (ret)
+			return ret;
 	}
 
-	if (!return_vq)
-		return false; /* no kick the vq */
+	if (vfd_in_over_limit(vfd, qentry->len)) {
+		unsigned int copy_limit = READ_ONCE(vfd_in_copy_limit);
 
-	mutex_lock(vq_lock);
-	ret = vq_return_inbuf_locked(vq, hdr);
-	mutex_unlock(vq_lock);
-	if (ret) {
-		printk("virtwl: failed to return inbuf to host: %d\n", ret);
-		kfree(hdr);
+		/* a reader that never reads must not take all of memory */
+		if (copy_limit &&
+		    vfd->in_copied_bytes + qentry->len > copy_limit) {
+			atomic_long_inc(&vi->in_dropped_msgs);
+			return -ENOBUFS;
+		}
+
+		copy = kmemdup(qentry->hdr, qentry->len, GFP_KERNEL);
+		if (!copy)
+			return -ENOMEM;
+		qentry->hdr = copy;
+		qentry->qp = NULL;
+		vfd->in_copied_bytes += qentry->len;
+		atomic_long_inc(&vi->in_overflow_msgs);
+		atomic_long_add(qentry->len, &vi->in_overflow_bytes);
+	} else {
+		vfd->in_held_bufs++;
+		vfd->in_held_bytes += qentry->len;
 	}
 
-	return true; /* kick the vq */
+	*vfd_qentry_at(vfd, vfd->in_head++) = *qentry;
+	return 0;
 }
 
-static void vq_in_work_handler(struct work_struct *work)
+/*
+ * Must hold vfd->lock. Gives the in vq buffers of the entries from in_tail up
+ * to end back to the host, or frees their copies. Consecutive entries from the
+ * same qp share one hold of its in vq lock and one kick.
+ */
+static void vfd_in_release(struct virtwl_vfd *vfd, unsigned int end)
 {
-	struct virtwl_info *vi = container_of(work, struct virtwl_info,
-					      in_vq_work);
-	struct virtqueue *vq = vi->vqs[VIRTWL_VQ_IN];
-	struct mutex *vq_lock = &vi->vq_locks[VIRTWL_VQ_IN];
-	void *buffer;
+	struct virtwl_vq_pair *locked_qp = NULL;
+	struct virtwl_vfd_qentry *qentry;
+
+	for (; vfd->in_tail != end; vfd->in_tail++) {
+		qentry = vfd_qentry_at(vfd, vfd->in_tail);
+
+		if (!qentry->qp) {
+			vfd->in_copied_bytes -= qentry->len;
+			kfree(qentry->hdr);
+			vfd_qentry_free(qentry);
+			continue;
+		}
+
+		if (qentry->qp != locked_qp) {
+			if (locked_qp) {
+				vq_kick(locked_qp, VIRTWL_VQ_IN);
+				mutex_unlock(&locked_qp->vq_locks[VIRTWL_VQ_IN]);
+			}
+			locked_qp = qentry->qp;
+			mutex_lock(&locked_qp->vq_locks[VIRTWL_VQ_IN]);
+		}
+
+		vq_return_inbuf_locked(locked_qp, qentry->hdr);
+		vfd->in_held_bufs--;
+		vfd->in_held_bytes -= qentry->len;
+		vfd_qentry_free(qentry);
+	}
+
+	if (locked_qp) {
+		vq_kick(locked_qp, VIRTWL_VQ_IN);
+		mutex_unlock(&locked_qp->vq_locks[VIRTWL_VQ_IN]);
+	}
+}
+
+static void *virtwl_ring_sq_slot(struct virtwl_ring *ring, u32 idx)
+{
+	return ring->pages[1 + (idx & (ring->slot_count - 1))];
+}
+
+static void *virtwl_ring_cq_slot(struct virtwl_ring *ring, u32 idx)
+{
+	return ring->pages[1 + ring->slot_count +
+			   (idx & (ring->slot_count - 1))];
+}
+
+static void virtwl_ring_free(struct virtwl_ring *ring)
+{
+	unsigned int i;
+
+	if (!ring)
+		return;
+
+	for (i = 0; i < ring->nr_pages && ring->pages; i++)
+		free_page((unsigned long)ring->pages[i]);
+	kfree(ring->sq_done);
+	kfree(ring->pages);
+	kfree(ring);
+}
+
+/*
+ * Must hold vfd->lock. Publishes a message without vfds on the cq of the vfd's
+ * ring, returns false if it has to be queued for recv instead.
+ */
+static bool vfd_ring_push_locked(struct virtwl_vfd *vfd, const void *data,
+				 size_t len)
+{
+	struct virtwl_ring *ring = vfd->ring;
+	struct virtwl_ring_slot *slot;
+
+	/* the cq must not overtake messages already queued for recv */
+	if (!ring || vfd->cq_disabled || vfd_in_pending(vfd) ||
+	    len > VIRTWL_RING_SLOT_DATA_MAX)
+		return false;
+
+	/* also false if the user moved cq_head past cq_tail */
+	if (ring->cq_tail - smp_load_acquire(&ring->hdr->cq_head) >=
+	    ring->slot_count)
+		return false;
+
+	slot = virtwl_ring_cq_slot(ring, ring->cq_tail);
+	memcpy(slot->data, data, len);
+	slot->len = len;
+	smp_store_release(&ring->hdr->cq_tail, ++ring->cq_tail);
+
+	return true;
+}
+
+static struct virtwl_vfd *vq_find_offer(struct virtwl_vq_pair *qp, u32 id)
+{
+	struct virtwl_vfd *vfd;
+
+	hash_for_each_possible(qp->offers, vfd, offer_node, id)
+		if (vfd->id == id)
+			return vfd;
+
+	return NULL;
+}
+
+static struct virtwl_vfd *vq_host_vfd_get(struct virtwl_vq_pair *qp)
+{
+	struct virtwl_vfd *vfd;
+
+	if (hlist_empty(&qp->host_vfd_pool))
+		return virtwl_vfd_alloc(qp->vi);
+
+	vfd = hlist_entry(qp->host_vfd_pool.first, struct virtwl_vfd,
+			  offer_node);
+	hlist_del(&vfd->offer_node);
+	qp->host_vfd_pool_count--;
+
+	return vfd;
+}
+
+/* Tops up host_vfd_pool, outside of the dispatch of any message. */
+static void vq_host_vfd_refill(struct virtwl_vq_pair *qp)
+{
+	struct virtwl_vfd *vfd;
+
+	while (qp->host_vfd_pool_count < VIRTWL_HOST_VFD_POOL_SIZE) {
+		vfd = virtwl_vfd_alloc(qp->vi);
+		if (!vfd)
+			break;
+		hlist_add_head(&vfd->offer_node, &qp->host_vfd_pool);
+		qp->host_vfd_pool_count++;
+	}
+}
+
+/* Drops the pool and any offers no recv took, once in_vq_work is done. */
+static void vq_host_vfd_drain(struct virtwl_vq_pair *qp)
+{
+	struct hlist_node *next;
+	struct virtwl_vfd *vfd;
+	unsigned int bkt;
+
+	hlist_for_each_entry_safe(vfd, next, &qp->host_vfd_pool, offer_node) {
+		hlist_del(&vfd->offer_node);
+		virtwl_vfd_put(vfd);
+	}
+	qp->host_vfd_pool_count = 0;
+
+	hash_for_each_safe(qp->offers, bkt, next, vfd, offer_node) {
+		hash_del(&vfd->offer_node);
+		virtwl_vfd_remove(vfd);
+	}
+}
+
+static bool vq_handle_new(struct virtwl_vq_pair *qp,
+			  struct virtio_wl_ctrl_vfd_new *new, unsigned int len)
+{
+	struct virtwl_info *vi = qp->vi;
+	struct virtwl_vfd *vfd;
+	u32 id = new->vfd_id;
+	int ret;
+
+	if (id == 0)
+		return true; /* return the inbuf to vq */
+
+	if (!(id & VFD_HOST_VFD_ID_BIT) || (id & VFD_ILLEGAL_SIGN_BIT)) {
+		printk("virtwl: received a vfd with invalid id: %u\n", id);
+		return true; /* return the inbuf to vq */
+	}
+
+	if (vq_find_offer(qp, id)) {
+		printk("virtwl: received a vfd with duplicate id: %u\n", id);
+		return true; /* return the inbuf to vq */
+	}
+
+	vfd = vq_host_vfd_get(qp);
+	if (!vfd)
+		return true; /* return the inbuf to vq */
+
+	vfd->id = id;
+	vfd->size = new->size;
+	vfd->pfn = new->pfn;
+	vfd->flags = new->flags;
+	vfd->qp = qp;
+
+	/*
+	 * Only a context can be the target of a recv, so only those need to be
+	 * found in vi->vfds. The others are only ever reached through offers
+	 * and the files they end up in.
+	 */
+	if (vfd->flags & VIRTIO_WL_VFD_CONTROL) {
+		mutex_lock(&vi->vfds_lock);
+		ret = idr_alloc(&vi->vfds, vfd, id, id + 1, GFP_KERNEL);
+		mutex_unlock(&vi->vfds_lock);
+
+		if (ret <= 0) {
+			virtwl_vfd_put(vfd);
+			printk("virtwl: failed to place received vfd: %d\n",
+			       ret);
+			return true; /* return the inbuf to vq */
+		}
+
+	} else {
+		spin_lock(&qp->host_vfds_lock);
+		list_add_tail(&vfd->host_node, &qp->host_vfds);
+		spin_unlock(&qp->host_vfds_lock);
+	}
+
+	/* the offer holds the initial reference until a recv takes it */
+	hash_add(qp->offers, &vfd->offer_node, id);
+
+	return true; /* return the inbuf to vq */
+}
+
+static bool vq_handle_recv(struct virtwl_vq_pair *qp,
+			   struct virtio_wl_ctrl_vfd_recv *recv,
+			   unsigned int len)
+{
+	struct virtwl_info *vi = qp->vi;
+	struct virtwl_vfd *vfd;
+	struct virtwl_vfd_qentry qentry = {};
+	__le32 *vfds_le = (__le32 *)(recv + 1);
+	u32 i;
+	int ret;
+
+	if (len < sizeof(*recv) ||
+	    recv->vfd_count > (len - sizeof(*recv)) / sizeof(__le32)) {
+		printk("virtwl: recv with invalid vfd_count %u\n",
+		       recv->vfd_count);
+		return true; /* return the inbuf to vq */
+	}
+
+	vfd = virtwl_vfd_find(vi, recv->vfd_id);
+	if (!vfd) {
+		virtwl_stat_add(vi, NULL, VIRTWL_STAT_UNKNOWN_VFDS, 1);
+		printk("virtwl: recv for unknown vfd_id %u\n", recv->vfd_id);
+		return true; /* return the inbuf to vq */
+	}
+
+	if (recv->vfd_count) {
+		qentry.vfds = kmalloc_array(recv->vfd_count,
+					    sizeof(*qentry.vfds), GFP_KERNEL);
+		if (!qentry.vfds) {
+			virtwl_vfd_put(vfd);
+			printk("virtwl: failed to allocate qentry for vfd\n");
+			return true; /* return the inbuf to vq */
+		}
+	}
+
+	/*
+	 * Resolve ids now so the reader never looks at vi->vfds. The initial
+	 * reference that the offer held stays with the vfd, the qentry takes
+	 * one of its own like any other lookup.
+	 */
+	for (i = 0; i < recv->vfd_count; i++) {
+		u32 vfd_id = le32_to_cpu(vfds_le[i]);
+		struct virtwl_vfd *recv_vfd = vq_find_offer(qp, vfd_id);
+
+		if (recv_vfd) {
+			hash_del(&recv_vfd->offer_node);
+			kref_get(&recv_vfd->refcount);
+		} else {
+			recv_vfd = virtwl_vfd_find(vi, vfd_id);
+		}
+		if (!recv_vfd) {
+			virtwl_stat_add(vi, vfd, VIRTWL_STAT_UNKNOWN_VFDS, 1);
+			printk("virtwl: received a vfd with unrecognized id: %u\n",
+			       vfd_id);
+			continue;
+		}
+		qentry.vfds[qentry.vfd_count++] = recv_vfd;
+	}
+
+	qentry.hdr = &recv->hdr;
+	qentry.len = len;
+	qentry.qp = qp;
+
+	virtwl_stat_add(vi, vfd, VIRTWL_STAT_MSGS_RECV, 1);
+	virtwl_stat_add(vi, vfd, VIRTWL_STAT_BYTES_RECV,
+			len - sizeof(*recv) - recv->vfd_count * sizeof(__le32));
+	virtwl_stat_add(vi, vfd, VIRTWL_STAT_VFDS_RECV, qentry.vfd_count);
+
+	mutex_lock(&vfd->lock);
+	if (!vfd->dead && !recv->vfd_count &&
+	    vfd_ring_push_locked(vfd, recv + 1, len - sizeof(*recv))) {
+		wake_up_interruptible(&vfd->in_waitq);
+		mutex_unlock(&vfd->lock);
+		virtwl_vfd_put(vfd);
+		return true; /* return the inbuf to vq */
+	}
+
+	ret = vfd->dead ? -EPIPE : vfd_in_push(vfd, &qentry);
+	if (ret) {
+		mutex_unlock(&vfd->lock);
+		vfd_qentry_free(&qentry);
+		virtwl_vfd_put(vfd);
+		if (ret == -ENOMEM)
+			printk("virtwl: failed to allocate qentry for vfd\n");
+		return true; /* return the inbuf to vq */
+	}
+
+	wake_up_interruptible(&vfd->in_waitq);
+	if (!list_empty(&vfd->aio_reads))
+		queue_work(vi->wq, &vfd->aio_work);
+	mutex_unlock(&vfd->lock);
+	virtwl_vfd_put(vfd);
+
+	/* the message was copied if the vfd is over its limits */
+	return !qentry.qp; /* return the inbuf to vq */
+}
+
+static bool vq_dispatch_hdr(struct virtwl_vq_pair *qp, unsigned int len,
+			    struct virtio_wl_ctrl_hdr *hdr)
+{
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_IN];
+	bool return_vq = true;
+	int ret;
+
+	/* in commands all start with the header and the vfd id */
+	trace_virtwl_dispatch(qp_index(qp), hdr->type,
+			      len >= sizeof(struct virtio_wl_ctrl_vfd) ?
+			      ((struct virtio_wl_ctrl_vfd *)hdr)->vfd_id : 0,
+			      len);
+
+	switch (hdr->type) {
+	case VIRTIO_WL_CMD_VFD_NEW:
+		return_vq = vq_handle_new(qp,
+					  (struct virtio_wl_ctrl_vfd_new *)hdr,
+					  len);
+		break;
+	case VIRTIO_WL_CMD_VFD_RECV:
+		return_vq = vq_handle_recv(qp,
+			(struct virtio_wl_ctrl_vfd_recv *)hdr, len);
+		break;
+	default:
+		printk("virtwl: unhandled ctrl command: %u\n", hdr->type);
+		break;
+	}
+
+	if (!return_vq)
+		return false; /* no kick the vq */
+
+	mutex_lock(vq_lock);
+	ret = vq_return_inbuf_locked(qp, hdr);
+	mutex_unlock(vq_lock);
+	if (ret) {
+		printk("virtwl: failed to return inbuf to host: %d\n", ret);
+		kfree(hdr);
+	}
+
+	return true; /* kick the vq */
+}
+
+static void vq_in_work_handler(struct work_struct *work)
+{
+	struct virtwl_vq_pair *qp = container_of(work, struct virtwl_vq_pair,
+						 in_vq_work);
+	struct virtqueue *vq = qp->vqs[VIRTWL_VQ_IN];
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_IN];
+	unsigned int budget = READ_ONCE(in_budget);
+	unsigned int handled = 0;
+	void *buffer;
 	unsigned int len;
 	bool kick_vq = false;
+	bool requeue = false;
+
+	/* the vqs may be gone by now */
+	if (READ_ONCE(qp->frozen))
+		return;
+
+	/* vq_in_cb left callbacks disabled, like a NAPI poll */
+	mutex_lock(vq_lock);
+	for (;;) {
+		while ((buffer = virtqueue_get_buf(vq, &len)) != NULL) {
+			struct virtio_wl_ctrl_hdr *hdr = buffer;
+			mutex_unlock(vq_lock);
+			kick_vq |= vq_dispatch_hdr(qp, len, hdr);
+			mutex_lock(vq_lock);
+			if (budget && ++handled >= budget)
+				break;
+		}
+
+		if (buffer) {
+			/* out of budget, leave callbacks off and run again */
+			requeue = true;
+			break;
+		}
+
+		/* catch buffers used between draining and re-enabling */
+		if (virtqueue_enable_cb(vq))
+			break;
+		virtqueue_disable_cb(vq);
+	}
+	mutex_unlock(vq_lock);
+
+	if (kick_vq)
+		vq_kick(qp, VIRTWL_VQ_IN);
+
+	vq_host_vfd_refill(qp);
+
+	trace_virtwl_in_work(qp_index(qp), handled, requeue);
+	if (requeue && !READ_ONCE(qp->frozen))
+		queue_work(qp->vi->wq, &qp->in_vq_work);
+}
+
+/*
+ * Wakes the pollers of the contexts that found the out vq full, and only
+ * those, once it has room again. The out_free store must come before.
+ */
+static void vq_out_wake_blocked(struct virtwl_vq_pair *qp)
+{
+	struct virtwl_vfd *vfd, *next;
+
+	if (!READ_ONCE(qp->out_free))
+		return;
+
+	spin_lock(&qp->out_blocked_lock);
+	list_for_each_entry_safe(vfd, next, &qp->out_blocked,
+				 out_blocked_node) {
+		list_del_init(&vfd->out_blocked_node);
+		wake_up_interruptible_poll(&vfd->out_waitq,
+					   POLLOUT | POLLWRNORM);
+	}
+	spin_unlock(&qp->out_blocked_lock);
+}
+
+/*
+ * Finishes every request the host has returned on the out vq. Returns true if
+ * there were any.
+ */
+static bool vq_out_reap(struct virtwl_vq_pair *qp)
+{
+	struct virtqueue *vq = qp->vqs[VIRTWL_VQ_OUT];
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_OUT];
+	unsigned int len;
+	struct virtwl_out_req *req;
+	unsigned int reaped = 0;
+	bool wake_waitq = false;
+	u64 latency_ns;
 
 	mutex_lock(vq_lock);
-	while ((buffer = virtqueue_get_buf(vq, &len)) != NULL) {
-		struct virtio_wl_ctrl_hdr *hdr = buffer;
+	while ((req = virtqueue_get_buf(vq, &len)) != NULL) {
+		wake_waitq = true;
+		reaped++;
+
+		/* a synchronous req may be gone as soon as it's completed */
+		latency_ns = ktime_get_ns() - req->queued_ns;
+		if (req->type == VIRTIO_WL_CMD_VFD_SEND)
+			virtwl_stat_send_latency(qp->vi, latency_ns);
+		trace_virtwl_out_complete(qp_index(qp), req->type, req->vfd_id,
+					  req->resp->type, latency_ns);
+
+		if (!req->finish) {
+			qp->out_waiters--;
+			complete(&req->finish_completion);
+			continue;
+		}
+		/* finish may free req and take other locks */
 		mutex_unlock(vq_lock);
-		kick_vq |= vq_dispatch_hdr(vi, len, hdr);
+		req->finish(req);
 		mutex_lock(vq_lock);
 	}
+	if (wake_waitq)
+		WRITE_ONCE(qp->out_free, vq->num_free);
 	mutex_unlock(vq_lock);
 
-	if (kick_vq)
-		virtqueue_kick(vq);
+	/* senders waiting for space and closers sleep uninterruptibly */
+	if (wake_waitq) {
+		wake_up(&qp->out_waitq);
+		vq_out_wake_blocked(qp);
+	}
+	trace_virtwl_out_work(qp_index(qp), reaped);
+
+	return wake_waitq;
+}
+
+static void vq_out_work_handler(struct work_struct *work)
+{
+	struct virtwl_vq_pair *qp = container_of(work, struct virtwl_vq_pair,
+						 out_vq_work);
+	struct virtqueue *vq = qp->vqs[VIRTWL_VQ_OUT];
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_OUT];
+	bool done;
+
+	if (READ_ONCE(qp->frozen))
+		return;
+
+	/* vq_out_cb left callbacks disabled */
+	do {
+		vq_out_reap(qp);
+
+		/*
+		 * Only interrupt again once most of the outstanding requests are
+		 * used, so that a burst of sends costs one interrupt, unless
+		 * someone is waiting for one of them.
+		 */
+		mutex_lock(vq_lock);
+		done = qp->out_waiters ? virtqueue_enable_cb(vq) :
+					 virtqueue_enable_cb_delayed(vq);
+		if (!done)
+			virtqueue_disable_cb(vq);
+		mutex_unlock(vq_lock);
+	} while (!done);
+}
+
+/*
+ * Polls the out vq for up to send_poll_usecs so that a short synchronous
+ * request can finish without waiting for an interrupt and the work item.
+ */
+static void vq_out_busy_poll(struct virtwl_vq_pair *qp,
+			     struct completion *done)
+{
+	unsigned int usecs = READ_ONCE(send_poll_usecs);
+	u64 deadline;
+
+	if (!usecs)
+		return;
+
+	deadline = ktime_get_ns() + (u64)usecs * NSEC_PER_USEC;
+	while (!completion_done(done) && !need_resched() &&
+	       ktime_get_ns() < deadline) {
+		if (!vq_out_reap(qp))
+			cpu_relax();
+	}
+}
+
+static struct virtwl_vq_pair *vq_to_qp(struct virtqueue *vq)
+{
+	struct virtwl_info *vi = vq->vdev->priv;
+
+	return &vi->qps[vq->index / VIRTWL_QUEUE_COUNT];
+}
+
+static void vq_in_cb(struct virtqueue *vq)
+{
+	struct virtwl_vq_pair *qp = vq_to_qp(vq);
+
+	virtqueue_disable_cb(vq);
+	queue_work(qp->vi->wq, &qp->in_vq_work);
+}
+
+static void vq_out_cb(struct virtqueue *vq)
+{
+	struct virtwl_vq_pair *qp = vq_to_qp(vq);
+
+	virtqueue_disable_cb(vq);
+	queue_work(qp->vi->wq, &qp->out_vq_work);
+}
+
+static struct virtwl_vfd *virtwl_vfd_alloc(struct virtwl_info *vi)
+{
+	struct virtwl_vfd *vfd = kzalloc(sizeof(struct virtwl_vfd), GFP_KERNEL);
+	if (!vfd)
+		return NULL;
+
+	kref_init(&vfd->refcount);
+	vfd->vi = vi;
+	vfd->qp = &vi->qps[0];
+
+	mutex_init(&vfd->lock);
+	init_waitqueue_head(&vfd->in_waitq);
+	init_waitqueue_head(&vfd->out_waitq);
+	INIT_LIST_HEAD(&vfd->out_blocked_node);
+	INIT_LIST_HEAD(&vfd->host_node);
+	spin_lock_init(&vfd->aio_lock);
+	INIT_LIST_HEAD(&vfd->aio_reads);
+	INIT_LIST_HEAD(&vfd->aio_cancelled);
+	INIT_WORK(&vfd->aio_work, vfd_aio_work_handler);
+	atomic_set(&vfd->sends_in_flight, 0);
+
+	return vfd;
 }
 
-static void vq_out_work_handler(struct work_struct *work)
-{
-	struct virtwl_info *vi = container_of(work, struct virtwl_info,
-					      out_vq_work);
-	struct virtqueue *vq = vi->vqs[VIRTWL_VQ_OUT];
-	struct mutex *vq_lock = &vi->vq_locks[VIRTWL_VQ_OUT];
-	unsigned int len;
-	struct completion *finish_completion;
-	bool wake_waitq = false;
+/* Locks the vfd and unlinks its id from vi */
+static void virtwl_vfd_lock_unlink(struct virtwl_vfd *vfd)
+{
+	struct virtwl_info *vi = vfd->vi;
+	/* this order is important to avoid deadlock */
+	mutex_lock(&vi->vfds_lock);
+	mutex_lock(&vfd->lock);
+	/* host vfds other than contexts never made it into vi->vfds */
+	if (idr_find(&vi->vfds, vfd->id) == vfd)
+		idr_remove(&vi->vfds, vfd->id);
+	mutex_unlock(&vi->vfds_lock);
+}
+
+/* Returns a new reference to the vfd with the given id, or NULL. */
+static struct virtwl_vfd *virtwl_vfd_find(struct virtwl_info *vi, u32 id)
+{
+	struct virtwl_vfd *vfd;
+
+	rcu_read_lock();
+	vfd = idr_find(&vi->vfds, id);
+	if (vfd && !kref_get_unless_zero(&vfd->refcount))
+		vfd = NULL;
+	rcu_read_unlock();
+
+	return vfd;
+}
+
+static void virtwl_vfd_kref_release(struct kref *refcount)
+{
+	struct virtwl_vfd *vfd = container_of(refcount, struct virtwl_vfd,
+					      refcount);
+
+	kfree(vfd->in_ring);
+	virtwl_ring_free(vfd->ring);
+	free_percpu(vfd->stats);
+	/* RCU lookups may still be looking at vfd */
+	kfree_rcu(vfd, rcu);
+}
+
+/*
+ * Drops a reference. The last one must not be dropped while vfd is in
+ * vi->vfds or still has queued virtio buffers, see virtwl_vfd_remove().
+ */
+static void virtwl_vfd_put(struct virtwl_vfd *vfd)
+{
+	kref_put(&vfd->refcount, virtwl_vfd_kref_release);
+}
+
+static void virtwl_vfd_import_release(struct virtwl_vfd *vfd)
+{
+	struct dma_buf *dmabuf = vfd->import_attach->dmabuf;
+
+	dma_buf_unmap_attachment(vfd->import_attach, vfd->import_sgt,
+				 DMA_BIDIRECTIONAL);
+	dma_buf_detach(dmabuf, vfd->import_attach);
+	dma_buf_put(dmabuf);
+	vfd->import_attach = NULL;
+	vfd->import_sgt = NULL;
+}
+
+/*
+ * Thread safe and also removes vfd from vi as well as any queued virtio buffers
+ */
+static void virtwl_vfd_remove(struct virtwl_vfd *vfd)
+{
+	virtwl_vfd_lock_unlink(vfd);
+
+	/* holders of other references must not queue any more buffers */
+	vfd->dead = true;
+
+	vfd_in_release(vfd, vfd->in_head);
+	vfd->in_data = vfd->in_vfds = vfd->in_tail;
+
+	mutex_unlock(&vfd->lock);
+	if (!list_empty(&vfd->host_node)) {
+		spin_lock(&vfd->qp->host_vfds_lock);
+		list_del_init(&vfd->host_node);
+		spin_unlock(&vfd->qp->host_vfds_lock);
+	}
+	if (vfd->import_attach)
+		virtwl_vfd_import_release(vfd);
+	virtwl_vfd_put(vfd);
+}
+
+/*
+ * Must hold vfd->lock. Moves the cursors past fully consumed entries and gives
+ * the buffers of entries before both cursors back to the host. Readers call
+ * this once per recv rather than once per message they consume.
+ */
+static void vfd_in_retire(struct virtwl_vfd *vfd)
+{
+	struct virtwl_vfd_qentry *qentry;
+	unsigned int end;
+
+	while (vfd->in_data != vfd->in_head) {
+		qentry = vfd_qentry_at(vfd, vfd->in_data);
+		if ((s64)qentry->data_offset < vfd_qentry_data_len(qentry))
+			break;
+		vfd->in_data++;
+	}
+
+	while (vfd->in_vfds != vfd->in_head) {
+		qentry = vfd_qentry_at(vfd, vfd->in_vfds);
+		if (qentry->vfd_offset < qentry->vfd_count)
+			break;
+		vfd->in_vfds++;
+	}
+
+	/* whichever cursor is closer to the tail */
+	end = vfd->in_data - vfd->in_tail < vfd->in_vfds - vfd->in_tail ?
+	      vfd->in_data : vfd->in_vfds;
+
+	vfd_in_release(vfd, end);
+}
+
+static ssize_t vfd_out_locked(struct virtwl_vfd *vfd, struct iov_iter *to)
+{
+	struct virtwl_vfd_qentry *qentry;
+	ssize_t read_count = 0;
+	size_t copied;
+
+	for (; vfd->in_data != vfd->in_head; vfd->in_data++) {
+		struct virtio_wl_ctrl_vfd_recv *recv;
+		size_t recv_offset;
+		ssize_t to_read;
+
+		qentry = vfd_qentry_at(vfd, vfd->in_data);
+		recv = (struct virtio_wl_ctrl_vfd_recv *)qentry->hdr;
+		recv_offset = sizeof(*recv) + recv->vfd_count *
+			      sizeof(__le32) + qentry->data_offset;
+		to_read = (ssize_t)qentry->len - (ssize_t)recv_offset;
+		if (to_read <= 0)
+			continue;
+		if (!iov_iter_count(to))
+			break;
+
+		if (to_read > iov_iter_count(to))
+			to_read = iov_iter_count(to);
+
+		copied = copy_to_iter((u8 *)recv + recv_offset, to_read, to);
+		read_count += copied;
+		qentry->data_offset += copied;
+
+		if (copied != to_read) {
+			/* return error unless we have some data to return */
+			if (read_count == 0)
+				read_count = -EFAULT;
+			break;
+		}
+
+		/* the user buffer is full before the entry's data ran out */
+		if ((s64)qentry->data_offset < vfd_qentry_data_len(qentry))
+			break;
+	}
+
+	return read_count;
+}
+
+/*
+ * Must hold vfd->lock. Each vfd returned in vfds holds a reference that the
+ * caller must put.
+ */
+static size_t vfd_out_vfds_locked(struct virtwl_vfd *vfd,
+				  struct virtwl_vfd **vfds, size_t count)
+{
+	struct virtwl_vfd_qentry *qentry;
+	size_t read_count = 0;
+
+	for (; vfd->in_vfds != vfd->in_head; vfd->in_vfds++) {
+		qentry = vfd_qentry_at(vfd, vfd->in_vfds);
+
+		/* the references move from the qentry to the caller */
+		while (qentry->vfd_offset < qentry->vfd_count &&
+		       read_count < count)
+			vfds[read_count++] = qentry->vfds[qentry->vfd_offset++];
+
+		if (qentry->vfd_offset < qentry->vfd_count)
+			break;
+	}
+
+	return read_count;
+}
+
+/* this can only be called if the caller has unique ownership of the vfd */
+static int do_vfd_close(struct virtwl_vfd *vfd)
+{
+	struct virtio_wl_ctrl_vfd *ctrl_close;
+	struct virtwl_info *vi = vfd->vi;
+	struct virtwl_out_req req;
+	struct scatterlist out_sg;
+	struct scatterlist in_sg;
+	struct scatterlist *sgs[] = { &out_sg, &in_sg };
+	u64 start_ns;
+	int ret = 0;
+
+	ctrl_close = virtwl_cmd_alloc(vi, sizeof(*ctrl_close));
+	if (!ctrl_close)
+		return -ENOMEM;
+
+	ctrl_close->hdr.type = VIRTIO_WL_CMD_VFD_CLOSE;
+	ctrl_close->vfd_id = vfd->id;
+
+	sg_init_one(&in_sg, &ctrl_close->hdr, sizeof(struct virtio_wl_ctrl_vfd));
+	sg_init_one(&out_sg, &ctrl_close->hdr, sizeof(struct virtio_wl_ctrl_hdr));
+
+	/* the host must not see the close before sends still in flight */
+	wait_event(vfd->qp->out_waitq, !atomic_read(&vfd->sends_in_flight));
+
+	virtwl_out_req_init(&req, NULL);
+	start_ns = ktime_get_ns();
+	ret = vq_queue_out(vfd->qp, sgs, 1, 1, &req, false /* block */);
+	if (ret) {
+		printk("virtwl: failed to queue close vfd id %u: %d\n", vfd->id,
+		       ret);
+		trace_virtwl_close(vfd->id, 1, ret, 0);
+		goto free_ctrl_close;
+	}
+
+	wait_for_completion(&req.finish_completion);
+	trace_virtwl_close(vfd->id, 1, virtwl_resp_err(ctrl_close->hdr.type),
+			   ktime_get_ns() - start_ns);
+	virtwl_stat_add(vi, NULL, VIRTWL_STAT_CLOSES, 1);
+	virtwl_stat_add(vi, NULL, VIRTWL_STAT_CLOSE_CMDS, 1);
+	virtwl_stat_add(vi, NULL, VIRTWL_STAT_CLOSE_NS,
+			ktime_get_ns() - start_ns);
+	virtwl_vfd_remove(vfd);
+
+free_ctrl_close:
+	virtwl_cmd_free(vi, ctrl_close, sizeof(*ctrl_close));
+	return ret;
+}
+
+static void vfd_close_finish(struct virtwl_out_req *req)
+{
+	struct virtwl_close *close = container_of(req, struct virtwl_close,
+						  req);
+	struct virtwl_info *vi = close->vi;
+	struct virtio_wl_ctrl_hdr *hdr = (struct virtio_wl_ctrl_hdr *)(close + 1);
+	struct virtwl_vfd *vfd, *next;
+	int ret = virtwl_resp_err(hdr->type);
+	unsigned int count = 0;
+
+	virtwl_stat_add(vi, NULL, VIRTWL_STAT_CLOSE_CMDS, 1);
+	virtwl_stat_add(vi, NULL, VIRTWL_STAT_CLOSE_NS,
+			ktime_get_ns() - close->start_ns);
+
+	if (trace_virtwl_close_enabled()) {
+		list_for_each_entry(vfd, &close->vfds, close_node)
+			count++;
+		vfd = list_first_entry(&close->vfds, struct virtwl_vfd,
+				       close_node);
+		trace_virtwl_close(vfd->id, count, ret,
+				   ktime_get_ns() - close->start_ns);
+	}
+
+	list_for_each_entry_safe(vfd, next, &close->vfds, close_node) {
+		if (ret)
+			printk("virtwl: failed to close vfd id %u: %d\n",
+			       vfd->id, ret);
+		list_del(&vfd->close_node);
+		virtwl_vfd_remove(vfd);
+		virtwl_stat_add(vi, NULL, VIRTWL_STAT_CLOSES, 1);
+	}
+
+	virtwl_cmd_free(vi, close, close->alloc_size);
+	if (atomic_dec_and_test(&vi->closes_in_flight))
+		wake_up(&vi->close_waitq);
+}
+
+/*
+ * Moves the first vfd in pending and, if the device takes batches, up to
+ * VIRTWL_CLOSE_BATCH_MAX - 1 others on the same qp into a new close command.
+ */
+static struct virtwl_close *virtwl_close_build(struct virtwl_info *vi,
+					       struct list_head *pending)
+{
+	bool batch = virtio_has_feature(vi->vdev, VIRTIO_WL_F_CLOSE_BATCH);
+	struct virtwl_vfd *first = list_first_entry(pending, struct virtwl_vfd,
+						    close_node);
+	struct virtwl_vfd *vfd, *next;
+	struct virtwl_close *close;
+	struct virtio_wl_ctrl_vfd_close_batch *ctrl_batch;
+	struct virtio_wl_ctrl_vfd *ctrl_close;
+	__le32 *ids;
+	size_t ctrl_size;
+	u32 count = 0;
+
+	ctrl_size = batch ? sizeof(*ctrl_batch) +
+			    VIRTWL_CLOSE_BATCH_MAX * sizeof(__le32) :
+			    sizeof(*ctrl_close);
+	close = virtwl_cmd_alloc(vi, sizeof(*close) + ctrl_size);
+	if (!close)
+		return NULL;
+
+	close->vi = vi;
+	close->alloc_size = sizeof(*close) + ctrl_size;
+	INIT_LIST_HEAD(&close->vfds);
+	virtwl_out_req_init(&close->req, vfd_close_finish);
+
+	ctrl_batch = (struct virtio_wl_ctrl_vfd_close_batch *)(close + 1);
+	ctrl_close = (struct virtio_wl_ctrl_vfd *)(close + 1);
+	ids = (__le32 *)(ctrl_batch + 1);
+
+	list_for_each_entry_safe(vfd, next, pending, close_node) {
+		if (vfd->qp != first->qp)
+			continue;
+
+		/* the host must not see the close before sends still in flight */
+		wait_event(vfd->qp->out_waitq,
+			   !atomic_read(&vfd->sends_in_flight));
+
+		list_move_tail(&vfd->close_node, &close->vfds);
+		if (batch)
+			ids[count] = cpu_to_le32(vfd->id);
+		else
+			ctrl_close->vfd_id = vfd->id;
+		if (!batch || ++count == VIRTWL_CLOSE_BATCH_MAX)
+			break;
+	}
+
+	if (batch) {
+		ctrl_batch->hdr.type = VIRTIO_WL_CMD_VFD_CLOSE_BATCH;
+		ctrl_batch->vfd_count = count;
+		sg_init_one(&close->out_sg, ctrl_batch,
+			    sizeof(*ctrl_batch) + count * sizeof(__le32));
+	} else {
+		ctrl_close->hdr.type = VIRTIO_WL_CMD_VFD_CLOSE;
+		sg_init_one(&close->out_sg, ctrl_close, sizeof(*ctrl_close));
+	}
+	sg_init_one(&close->in_sg, ctrl_batch, sizeof(struct virtio_wl_ctrl_hdr));
+	close->sgs[0] = &close->out_sg;
+	close->sgs[1] = &close->in_sg;
+
+	return close;
+}
+
+static void virtwl_close_work_handler(struct work_struct *work)
+{
+	struct virtwl_info *vi = container_of(to_delayed_work(work),
+					      struct virtwl_info, close_work);
+	struct virtwl_close *close;
+	struct virtwl_vfd *vfd;
+	LIST_HEAD(pending);
+	int ret;
+
+	spin_lock(&vi->close_lock);
+	list_splice_init(&vi->close_pending, &pending);
+	spin_unlock(&vi->close_lock);
+
+	while (!list_empty(&pending)) {
+		close = virtwl_close_build(vi, &pending);
+		if (!close)
+			goto retry;
+
+		vfd = list_first_entry(&close->vfds, struct virtwl_vfd,
+				       close_node);
+		atomic_inc(&vi->closes_in_flight);
+		close->start_ns = ktime_get_ns();
+		ret = vq_queue_out(vfd->qp, close->sgs, 1, 1, &close->req,
+				   false /* block */);
+		if (ret) {
+			printk("virtwl: failed to queue close vfd id %u: %d\n",
+			       vfd->id, ret);
+			list_splice(&close->vfds, &pending);
+			virtwl_cmd_free(vi, close, close->alloc_size);
+			if (atomic_dec_and_test(&vi->closes_in_flight))
+				wake_up(&vi->close_waitq);
+			goto retry;
+		}
+	}
+	return;
+
+retry:
+	/* try again later rather than lose the closes */
+	spin_lock(&vi->close_lock);
+	list_splice(&pending, &vi->close_pending);
+	spin_unlock(&vi->close_lock);
+	queue_delayed_work(vi->wq, &vi->close_work, HZ);
+}
+
+/*
+ * Closes a vfd without waiting for the host. The caller must have unique
+ * ownership of the vfd, as for do_vfd_close(). Closes within close_delay_usecs
+ * of each other share a command if the device takes batches.
+ */
+static void virtwl_vfd_close_async(struct virtwl_vfd *vfd)
+{
+	struct virtwl_info *vi = vfd->vi;
+
+	spin_lock(&vi->close_lock);
+	list_add_tail(&vfd->close_node, &vi->close_pending);
+	spin_unlock(&vi->close_lock);
+
+	/* the first close of a window starts the timer, later ones join it */
+	queue_delayed_work(vi->wq, &vi->close_work,
+			   usecs_to_jiffies(READ_ONCE(close_delay_usecs)));
+}
+
+/*
+ * Sends the pending closes and waits for every close in flight to finish, for
+ * when the device goes away. Closes that could not be queued stay pending.
+ */
+static void virtwl_close_flush(struct virtwl_info *vi)
+{
+	flush_delayed_work(&vi->close_work);
+	/* vfd_close_finish must not run once vi is gone */
+	wait_event(vi->close_waitq, !atomic_read(&vi->closes_in_flight));
+}
+
+/* Drops the closes left pending once the device is reset. */
+static void virtwl_close_drain(struct virtwl_info *vi)
+{
+	struct virtwl_vfd *vfd, *next;
+
+	cancel_delayed_work_sync(&vi->close_work);
+	list_for_each_entry_safe(vfd, next, &vi->close_pending, close_node) {
+		list_del(&vfd->close_node);
+		virtwl_vfd_remove(vfd);
+	}
+}
+
+static ssize_t virtwl_vfd_recv(struct file *filp, struct iov_iter *to,
+			       struct virtwl_vfd **vfds, size_t *vfd_count)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	ssize_t read_count = 0;
+	size_t vfd_read_count = 0;
+	unsigned int tail;
+
+	mutex_lock(&vfd->lock);
+	/* from now on messages wait here rather than on the cq */
+	vfd->cq_disabled = true;
+
+	while (read_count == 0 && vfd_read_count == 0) {
+		while (!vfd_in_pending(vfd)) {
+			mutex_unlock(&vfd->lock);
+			if (filp->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+
+			if (wait_event_interruptible(vfd->in_waitq,
+				READ_ONCE(vfd->in_head) !=
+				READ_ONCE(vfd->in_tail)))
+				return -ERESTARTSYS;
+
+			mutex_lock(&vfd->lock);
+		}
+
+		tail = vfd->in_tail;
+		read_count = vfd_out_locked(vfd, to);
+		if (read_count >= 0 && vfds && vfd_count && *vfd_count)
+			vfd_read_count = vfd_out_vfds_locked(vfd, vfds,
+							     *vfd_count);
+		/* one batch of returned buffers and one kick per pass */
+		vfd_in_retire(vfd);
+		if (read_count < 0)
+			goto out_unlock;
+
+		/* what's pending doesn't fit, e.g. only vfds and no room for them */
+		if (!read_count && !vfd_read_count && vfd->in_tail == tail)
+			break;
+	}
+
+	*vfd_count = vfd_read_count;
+
+out_unlock:
+	mutex_unlock(&vfd->lock);
+	return read_count;
+}
+
+static int virtwl_vfd_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct virtwl_vfd *vfd = vma->vm_private_data;
+	unsigned long addr = (unsigned long)vmf->virtual_address;
+	int ret;
+
+	/* pfn and size never change once the vfd is created */
+	if (vmf->pgoff >= PAGE_ALIGN(vfd->size) >> PAGE_SHIFT)
+		return VM_FAULT_SIGBUS;
+
+	ret = vm_insert_pfn(vma, addr, vfd->pfn + vmf->pgoff);
+	if (ret == -ENOMEM)
+		return VM_FAULT_OOM;
+	/* -EBUSY means another thread mapped the page first */
+	if (ret < 0 && ret != -EBUSY)
+		return VM_FAULT_SIGBUS;
+
+	return VM_FAULT_NOPAGE;
+}
+
+static const struct vm_operations_struct virtwl_vfd_vm_ops = {
+	.fault = virtwl_vfd_fault,
+};
+
+/* Must hold vfd->lock. Maps the whole ring of a context. */
+static int virtwl_ring_mmap(struct virtwl_vfd *vfd, struct vm_area_struct *vma)
+{
+	struct virtwl_ring *ring = vfd->ring;
+	unsigned long addr = vma->vm_start;
+	unsigned int i;
+	int ret;
+
+	if (!ring)
+		return -EACCES;
+
+	/* a private mapping would write the user's indices to a copy */
+	if (!(vma->vm_flags & VM_SHARED) || vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start !=
+	    (unsigned long)ring->nr_pages << PAGE_SHIFT)
+		return -EINVAL;
+
+	vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+	if (!(vma->vm_flags & VM_WRITE))
+		vma->vm_flags &= ~VM_MAYWRITE;
+	for (i = 0; i < ring->nr_pages; i++, addr += PAGE_SIZE) {
+		ret = vm_insert_page(vma, addr, virt_to_page(ring->pages[i]));
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int virtwl_vfd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	unsigned long vm_size = vma->vm_end - vma->vm_start;
+	int ret = 0;
+
+	mutex_lock(&vfd->lock);
+
+	if (vfd->flags & VIRTIO_WL_VFD_CONTROL) {
+		ret = virtwl_ring_mmap(vfd, vma);
+		goto out_unlock;
+	}
+
+	/* the vma takes a reference to the dma-buf in place of the vfd */
+	if (vfd->import_attach) {
+		ret = dma_buf_mmap(vfd->import_attach->dmabuf, vma,
+				   vma->vm_pgoff);
+		goto out_unlock;
+	}
+
+	if (!(vfd->flags & VIRTIO_WL_VFD_MAP)) {
+		ret = -EACCES;
+		goto out_unlock;
+	}
+
+	if ((vma->vm_flags & VM_WRITE) && !(vfd->flags & VIRTIO_WL_VFD_WRITE)) {
+		ret = -EACCES;
+		goto out_unlock;
+	}
+
+	if (vm_size + (vma->vm_pgoff << PAGE_SHIFT) > PAGE_ALIGN(vfd->size)) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	vma->vm_flags |= VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+
+	/* faults and remaps below all take their caching from vm_page_prot */
+	switch (vfd->caching) {
+	case VIRTWL_IOCTL_NEW_ALLOC_WC:
+		vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+		break;
+	case VIRTWL_IOCTL_NEW_ALLOC_UC:
+		vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+		break;
+	}
+
+	/* private mappings can't take pfns from faults, map them up front */
+	if (!(vma->vm_flags & VM_SHARED)) {
+		ret = io_remap_pfn_range(vma, vma->vm_start,
+					 vfd->pfn + vma->vm_pgoff, vm_size,
+					 vma->vm_page_prot);
+		goto out_unlock;
+	}
+
+	/* the file, and so the vfd, lives as long as the vma */
+	vma->vm_ops = &virtwl_vfd_vm_ops;
+	vma->vm_private_data = vfd;
+
+out_unlock:
+	mutex_unlock(&vfd->lock);
+	return ret;
+}
+
+/* An exported dma-buf's priv is the file of the vfd, which it keeps open. */
+static struct virtwl_vfd *dmabuf_to_vfd(struct dma_buf *dmabuf)
+{
+	struct file *filp = dmabuf->priv;
+
+	return filp->private_data;
+}
+
+static struct sg_table *virtwl_dmabuf_map(struct dma_buf_attachment *attach,
+					  enum dma_data_direction dir)
+{
+	struct virtwl_vfd *vfd = dmabuf_to_vfd(attach->dmabuf);
+	struct sg_table *sgt;
+	dma_addr_t addr;
+	int ret;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = sg_alloc_table(sgt, 1, GFP_KERNEL);
+	if (ret)
+		goto free_sgt;
+
+	/* pages injected by the host have no struct page, only an address */
+	addr = dma_map_resource(attach->dev, PFN_PHYS(vfd->pfn),
+				attach->dmabuf->size, dir, 0);
+	if (dma_mapping_error(attach->dev, addr)) {
+		ret = -ENOMEM;
+		goto free_table;
+	}
+	sg_dma_address(sgt->sgl) = addr;
+	sg_dma_len(sgt->sgl) = attach->dmabuf->size;
+
+	return sgt;
+
+free_table:
+	sg_free_table(sgt);
+free_sgt:
+	kfree(sgt);
+	return ERR_PTR(ret);
+}
+
+static void virtwl_dmabuf_unmap(struct dma_buf_attachment *attach,
+				struct sg_table *sgt,
+				enum dma_data_direction dir)
+{
+	dma_unmap_resource(attach->dev, sg_dma_address(sgt->sgl),
+			   sg_dma_len(sgt->sgl), dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static void virtwl_dmabuf_release(struct dma_buf *dmabuf)
+{
+	fput(dmabuf->priv);
+}
+
+/* there are no pages to kmap, importers have to use vmap or mmap */
+static void *virtwl_dmabuf_kmap(struct dma_buf *dmabuf, unsigned long page)
+{
+	return NULL;
+}
+
+static void *virtwl_dmabuf_vmap(struct dma_buf *dmabuf)
+{
+	struct virtwl_vfd *vfd = dmabuf_to_vfd(dmabuf);
+
+	switch (vfd->caching) {
+	case VIRTWL_IOCTL_NEW_ALLOC_WC:
+		return memremap(PFN_PHYS(vfd->pfn), dmabuf->size, MEMREMAP_WC);
+	case VIRTWL_IOCTL_NEW_ALLOC_UC:
+		return NULL;
+	default:
+		return memremap(PFN_PHYS(vfd->pfn), dmabuf->size, MEMREMAP_WB);
+	}
+}
+
+static void virtwl_dmabuf_vunmap(struct dma_buf *dmabuf, void *vaddr)
+{
+	memunmap(vaddr);
+}
+
+static int virtwl_dmabuf_mmap(struct dma_buf *dmabuf,
+			      struct vm_area_struct *vma)
+{
+	return virtwl_vfd_mmap(dmabuf->priv, vma);
+}
+
+static const struct dma_buf_ops virtwl_dmabuf_ops = {
+	.map_dma_buf = virtwl_dmabuf_map,
+	.unmap_dma_buf = virtwl_dmabuf_unmap,
+	.release = virtwl_dmabuf_release,
+	.kmap = virtwl_dmabuf_kmap,
+	.kmap_atomic = virtwl_dmabuf_kmap,
+	.vmap = virtwl_dmabuf_vmap,
+	.vunmap = virtwl_dmabuf_vunmap,
+	.mmap = virtwl_dmabuf_mmap,
+};
+
+static unsigned int virtwl_vfd_poll(struct file *filp,
+				    struct poll_table_struct *wait)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	struct virtwl_vq_pair *qp = vfd->qp;
+	struct virtwl_ring *ring = smp_load_acquire(&vfd->ring);
+	unsigned int mask = 0;
+
+	/* every read here is a lockless snapshot, like any poll result */
+	poll_wait(filp, &vfd->out_waitq, wait);
+	if (!READ_ONCE(qp->out_free)) {
+		/* vq_out_wake_blocked either sees us or we see its out_free */
+		spin_lock(&qp->out_blocked_lock);
+		if (list_empty(&vfd->out_blocked_node))
+			list_add_tail(&vfd->out_blocked_node,
+				      &qp->out_blocked);
+		spin_unlock(&qp->out_blocked_lock);
+	}
+	if (READ_ONCE(qp->out_free))
+		mask |= POLLOUT | POLLWRNORM;
+
+	if (READ_ONCE(vfd->send_err))
+		mask |= POLLERR;
+
+	poll_wait(filp, &vfd->in_waitq, wait);
+	if (READ_ONCE(vfd->in_head) != READ_ONCE(vfd->in_tail) ||
+	    (ring && READ_ONCE(ring->cq_tail) != READ_ONCE(ring->hdr->cq_head)))
+		mask |= POLLIN | POLLRDNORM;
+
+	return mask;
+}
+
+/* Only the caching and huge placement flags of a new alloc are in the key. */
+static u32 virtwl_alloc_cache_key(u32 size, u32 flags)
+{
+	return PAGE_ALIGN(size) | (flags & (VIRTWL_IOCTL_NEW_ALLOC_HUGE |
+					    VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK));
+}
+
+static u32 virtwl_vfd_cache_key(struct virtwl_vfd *vfd)
+{
+	return virtwl_alloc_cache_key(vfd->size, vfd->caching |
+				      (vfd->huge ? VIRTWL_IOCTL_NEW_ALLOC_HUGE :
+						   0));
+}
+
+/* Must hold vi->alloc_cache_lock. */
+static void virtwl_alloc_cache_unlink(struct virtwl_info *vi,
+				      struct virtwl_vfd *vfd)
+{
+	hash_del(&vfd->cache_node);
+	list_del(&vfd->cache_lru);
+	vi->alloc_cache_count--;
+}
+
+static void virtwl_alloc_cache_close(struct list_head *vfds)
+{
+	struct virtwl_vfd *vfd, *next;
+
+	list_for_each_entry_safe(vfd, next, vfds, cache_lru) {
+		list_del(&vfd->cache_lru);
+		virtwl_vfd_close_async(vfd);
+	}
+}
+
+/*
+ * Keeps a closed allocation open on the host for reuse. Returns false if vfd
+ * can't be cached, in which case the caller closes it.
+ */
+static bool virtwl_alloc_cache_put(struct virtwl_vfd *vfd)
+{
+	struct virtwl_info *vi = vfd->vi;
+	unsigned int limit = READ_ONCE(alloc_cache_size);
+	LIST_HEAD(evicted);
+
+	/*
+	 * The file is released, so nothing maps it anymore. Host vfds and
+	 * uncached ones, which can't be cleared, are never reused.
+	 */
+	if (!limit || (vfd->id & VFD_HOST_VFD_ID_BIT) ||
+	    !(vfd->flags & VIRTIO_WL_VFD_MAP) || READ_ONCE(vfd->shared) ||
+	    vfd->caching == VIRTWL_IOCTL_NEW_ALLOC_UC)
+		return false;
+
+	mutex_lock(&vi->alloc_cache_lock);
+	while (vi->alloc_cache_count >= limit) {
+		struct virtwl_vfd *oldest =
+			list_first_entry(&vi->alloc_cache_lru,
+					 struct virtwl_vfd, cache_lru);
+
+		virtwl_alloc_cache_unlink(vi, oldest);
+		list_add_tail(&oldest->cache_lru, &evicted);
+	}
+	hash_add(vi->alloc_cache, &vfd->cache_node,
+		 virtwl_vfd_cache_key(vfd));
+	list_add_tail(&vfd->cache_lru, &vi->alloc_cache_lru);
+	vi->alloc_cache_count++;
+	mutex_unlock(&vi->alloc_cache_lock);
+
+	virtwl_alloc_cache_close(&evicted);
+	return true;
+}
+
+/*
+ * Returns a cached allocation of size bytes made with the same caching and
+ * huge placement as the new alloc flags ask for, with its memory cleared, or
+ * NULL if there is none.
+ */
+static struct virtwl_vfd *virtwl_alloc_cache_get(struct virtwl_info *vi,
+						 u32 size, u32 flags)
+{
+	u32 key = virtwl_alloc_cache_key(size, flags);
+	u32 caching = flags & VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK;
+	struct virtwl_vfd *vfd, *found = NULL;
+	LIST_HEAD(unusable);
+	void *mem;
+
+	if (!READ_ONCE(vi->alloc_cache_count))
+		return NULL;
+
+	mutex_lock(&vi->alloc_cache_lock);
+	hash_for_each_possible(vi->alloc_cache, vfd, cache_node, key) {
+		if (virtwl_vfd_cache_key(vfd) == key) {
+			virtwl_alloc_cache_unlink(vi, vfd);
+			found = vfd;
+			break;
+		}
+	}
+	mutex_unlock(&vi->alloc_cache_lock);
+
+	if (!found)
+		return NULL;
+
+	/*
+	 * The last user may have been another process. Clear the memory with
+	 * its caching so nothing stale is left in the CPU caches.
+	 */
+	mem = memremap((resource_size_t)found->pfn << PAGE_SHIFT,
+		       PAGE_ALIGN(found->size),
+		       caching == VIRTWL_IOCTL_NEW_ALLOC_WC ? MEMREMAP_WC :
+							      MEMREMAP_WB);
+	if (!mem) {
+		list_add_tail(&found->cache_lru, &unusable);
+		virtwl_alloc_cache_close(&unusable);
+		return NULL;
+	}
+	memset(mem, 0, PAGE_ALIGN(found->size));
+	memunmap(mem);
+
+	virtwl_stat_add(vi, NULL, VIRTWL_STAT_ALLOC_CACHE_HITS, 1);
+	return found;
+}
+
+static unsigned long virtwl_alloc_cache_count(struct shrinker *shrinker,
+					      struct shrink_control *sc)
+{
+	struct virtwl_info *vi = container_of(shrinker, struct virtwl_info,
+					      alloc_cache_shrinker);
+
+	return READ_ONCE(vi->alloc_cache_count);
+}
+
+static unsigned long virtwl_alloc_cache_scan(struct shrinker *shrinker,
+					     struct shrink_control *sc)
+{
+	struct virtwl_info *vi = container_of(shrinker, struct virtwl_info,
+					      alloc_cache_shrinker);
+	unsigned long freed = 0;
+	LIST_HEAD(evicted);
+
+	if (!mutex_trylock(&vi->alloc_cache_lock))
+		return SHRINK_STOP;
+
+	while (freed < sc->nr_to_scan && !list_empty(&vi->alloc_cache_lru)) {
+		struct virtwl_vfd *vfd =
+			list_first_entry(&vi->alloc_cache_lru,
+					 struct virtwl_vfd, cache_lru);
+
+		virtwl_alloc_cache_unlink(vi, vfd);
+		list_add_tail(&vfd->cache_lru, &evicted);
+		freed++;
+	}
+	mutex_unlock(&vi->alloc_cache_lock);
+
+	/* the closes are asynchronous, reclaim never waits on the host */
+	virtwl_alloc_cache_close(&evicted);
+
+	return freed;
+}
+
+/* Closes every cached allocation, for when the device goes away. */
+static void virtwl_alloc_cache_drain(struct virtwl_info *vi)
+{
+	LIST_HEAD(vfds);
+
+	unregister_shrinker(&vi->alloc_cache_shrinker);
+
+	mutex_lock(&vi->alloc_cache_lock);
+	while (!list_empty(&vi->alloc_cache_lru)) {
+		struct virtwl_vfd *vfd =
+			list_first_entry(&vi->alloc_cache_lru,
+					 struct virtwl_vfd, cache_lru);
+
+		virtwl_alloc_cache_unlink(vi, vfd);
+		list_add_tail(&vfd->cache_lru, &vfds);
+	}
+	mutex_unlock(&vi->alloc_cache_lock);
+
+	virtwl_alloc_cache_close(&vfds);
+}
+
+static int virtwl_vfd_release(struct inode *inodep, struct file *filp)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+
+	/*
+	 * if release is called, filp must be out of references and we have the
+	 * last reference
+	 */
+	cancel_work_sync(&vfd->aio_work);
+
+	spin_lock(&vfd->qp->out_blocked_lock);
+	list_del_init(&vfd->out_blocked_node);
+	spin_unlock(&vfd->qp->out_blocked_lock);
+
+	if (!virtwl_alloc_cache_put(vfd))
+		virtwl_vfd_close_async(vfd);
+	return 0;
+}
+
+static ssize_t in_overflow_msgs_show(struct device *dev,
+				     struct device_attribute *attr, char *buf)
+{
+	struct virtwl_info *vi = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+			 atomic_long_read(&vi->in_overflow_msgs));
+}
+static DEVICE_ATTR_RO(in_overflow_msgs);
+
+static ssize_t in_overflow_bytes_show(struct device *dev,
+				      struct device_attribute *attr, char *buf)
+{
+	struct virtwl_info *vi = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+			 atomic_long_read(&vi->in_overflow_bytes));
+}
+static DEVICE_ATTR_RO(in_overflow_bytes);
+
+static ssize_t in_dropped_msgs_show(struct device *dev,
+				    struct device_attribute *attr, char *buf)
+{
+	struct virtwl_info *vi = dev_get_drvdata(dev);
+
+	return scnprintf(buf, PAGE_SIZE, "%ld\n",
+			 atomic_long_read(&vi->in_dropped_msgs));
+}
+static DEVICE_ATTR_RO(in_dropped_msgs);
+
+static struct attribute *virtwl_attrs[] = {
+	&dev_attr_in_overflow_msgs.attr,
+	&dev_attr_in_overflow_bytes.attr,
+	&dev_attr_in_dropped_msgs.attr,
+	NULL,
+};
+ATTRIBUTE_GROUPS(virtwl);
+
+static const char * const virtwl_stat_names[VIRTWL_STAT_COUNT] = {
+	[VIRTWL_STAT_MSGS_SENT] = "msgs_sent",
+	[VIRTWL_STAT_BYTES_SENT] = "bytes_sent",
+	[VIRTWL_STAT_VFDS_SENT] = "vfds_sent",
+	[VIRTWL_STAT_MSGS_RECV] = "msgs_recv",
+	[VIRTWL_STAT_BYTES_RECV] = "bytes_recv",
+	[VIRTWL_STAT_VFDS_RECV] = "vfds_recv",
+	[VIRTWL_STAT_UNKNOWN_VFDS] = "unknown_vfds",
+	[VIRTWL_STAT_QUEUE_FULL] = "queue_full",
+	[VIRTWL_STAT_CTXS] = "ctxs",
+	[VIRTWL_STAT_ALLOCS] = "allocs",
+	[VIRTWL_STAT_ALLOC_NS] = "alloc_ns",
+	[VIRTWL_STAT_ALLOC_CACHE_HITS] = "alloc_cache_hits",
+	[VIRTWL_STAT_CLOSES] = "closes",
+	[VIRTWL_STAT_CLOSE_CMDS] = "close_cmds",
+	[VIRTWL_STAT_CLOSE_NS] = "close_ns",
+};
+
+/* debugfs stats: the device's counters, then the state of each qp. */
+static int virtwl_stats_show(struct seq_file *m, void *unused)
+{
+	struct virtwl_info *vi = m->private;
+	struct virtwl_stats sum;
+	unsigned int i;
+
+	virtwl_stats_sum(vi->stats, &sum);
+	for (i = 0; i < VIRTWL_STAT_COUNT; i++)
+		seq_printf(m, "%s: %llu\n", virtwl_stat_names[i], sum.v[i]);
+
+	for (i = 0; i < vi->qp_count; i++) {
+		struct virtwl_vq_pair *qp = &vi->qps[i];
+
+		/* the vqs are gone while frozen */
+		mutex_lock(&qp->vq_locks[VIRTWL_VQ_IN]);
+		if (qp->frozen)
+			seq_printf(m, "qp%u: frozen\n", i);
+		else
+			seq_printf(m, "qp%u: in_free %u out_free %u out_blocked %d\n",
+				   i, qp->vqs[VIRTWL_VQ_IN]->num_free,
+				   READ_ONCE(qp->out_free),
+				   !list_empty(&qp->out_blocked));
+		mutex_unlock(&qp->vq_locks[VIRTWL_VQ_IN]);
+	}
+
+	return 0;
+}
+
+static int virtwl_stats_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, virtwl_stats_show, inode->i_private);
+}
+
+static const struct file_operations virtwl_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = virtwl_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs contexts: one line of counters and queue depth per context. */
+static int virtwl_contexts_show(struct seq_file *m, void *unused)
+{
+	struct virtwl_info *vi = m->private;
+	struct virtwl_stats sum;
+	struct virtwl_vfd *vfd;
+	unsigned int i;
+	int id;
+
+	seq_puts(m, "id qp in_queue");
+	for (i = 0; i < VIRTWL_STAT_COUNT; i++)
+		seq_printf(m, " %s", virtwl_stat_names[i]);
+	seq_putc(m, '\n');
+
+	/* vfds in the idr keep their stats until they are removed from it */
+	mutex_lock(&vi->vfds_lock);
+	idr_for_each_entry(&vi->vfds, vfd, id) {
+		if (!vfd->stats)
+			continue;
+
+		virtwl_stats_sum(vfd->stats, &sum);
+		seq_printf(m, "%u %u %u", vfd->id,
+			   qp_index(vfd->qp),
+			   READ_ONCE(vfd->in_head) - READ_ONCE(vfd->in_tail));
+		for (i = 0; i < VIRTWL_STAT_COUNT; i++)
+			seq_printf(m, " %llu", sum.v[i]);
+		seq_putc(m, '\n');
+	}
+	mutex_unlock(&vi->vfds_lock);
+
+	return 0;
+}
+
+static int virtwl_contexts_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, virtwl_contexts_show, inode->i_private);
+}
+
+static const struct file_operations virtwl_contexts_fops = {
+	.owner = THIS_MODULE,
+	.open = virtwl_contexts_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* debugfs send_latency: a histogram of VFD_SEND round trips in usecs. */
+static int virtwl_send_latency_show(struct seq_file *m, void *unused)
+{
+	struct virtwl_info *vi = m->private;
+	struct virtwl_stats sum;
+	unsigned int i;
+
+	virtwl_stats_sum(vi->stats, &sum);
+	for (i = 0; i < VIRTWL_LAT_BUCKETS - 1; i++)
+		seq_printf(m, "%llu-%llu: %llu\n", i ? 1ULL << (i - 1) : 0,
+			   (1ULL << i) - 1, sum.send_lat[i]);
+	seq_printf(m, "%llu-: %llu\n", 1ULL << (i - 1), sum.send_lat[i]);
+
+	return 0;
+}
+
+static int virtwl_send_latency_open(struct inode *inode, struct file *filp)
+{
+	return single_open(filp, virtwl_send_latency_show, inode->i_private);
+}
+
+static const struct file_operations virtwl_send_latency_fops = {
+	.owner = THIS_MODULE,
+	.open = virtwl_send_latency_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* Best effort, the driver works the same without debugfs. */
+static void virtwl_debugfs_init(struct virtwl_info *vi)
+{
+	char name[32];
+
+	snprintf(name, sizeof(name), KBUILD_MODNAME "-%s",
+		 dev_name(&vi->vdev->dev));
+	vi->debugfs = debugfs_create_dir(name, NULL);
+	if (IS_ERR_OR_NULL(vi->debugfs)) {
+		vi->debugfs = NULL;
+		return;
+	}
+
+	debugfs_create_file("stats", 0444, vi->debugfs, vi,
+			    &virtwl_stats_fops);
+	debugfs_create_file("contexts", 0444, vi->debugfs, vi,
+			    &virtwl_contexts_fops);
+	debugfs_create_file("send_latency", 0444, vi->debugfs, vi,
+			    &virtwl_send_latency_fops);
+}
+
+static int virtwl_open(struct inode *inodep, struct file *filp)
+{
+	struct virtwl_info *vi = container_of(inodep->i_cdev,
+					      struct virtwl_info, cdev);
+
+	filp->private_data = vi;
+
+	return 0;
+}
+
+static void virtwl_send_free(struct virtwl_send *send)
+{
+	int i;
+
+	if (send->pages) {
+		sg_free_table(&send->data_sgt);
+		for (i = 0; i < send->nr_pages; i++)
+			put_page(send->pages[i]);
+		kfree(send->pages);
+	}
+	virtwl_cmd_free(send->vfd->vi, send, send->alloc_size);
+}
+
+/*
+ * Pins the user pages behind data and describes them with send->data_sgt so
+ * the host reads the payload straight out of them.
+ */
+static int virtwl_send_pin(struct virtwl_send *send, struct iov_iter *data)
+{
+	int nr_pages = iov_iter_npages(data, INT_MAX);
+	struct scatterlist *sg;
+	struct scatterlist *last = NULL;
+	int ret;
+
+	send->pages = kmalloc_array(nr_pages, sizeof(*send->pages),
+				    GFP_KERNEL);
+	if (!send->pages)
+		return -ENOMEM;
+
+	ret = sg_alloc_table(&send->data_sgt, nr_pages, GFP_KERNEL);
+	if (ret) {
+		/* keep virtwl_send_free from freeing a table that isn't set up */
+		send->data_sgt.sgl = NULL;
+		send->data_sgt.orig_nents = 0;
+		return ret;
+	}
+
+	sg = send->data_sgt.sgl;
+	while (iov_iter_count(data)) {
+		size_t start;
+		ssize_t bytes;
+		int first = send->nr_pages;
+		int i;
+
+		bytes = iov_iter_get_pages(data, &send->pages[first], SIZE_MAX,
+					   nr_pages - first, &start);
+		if (bytes <= 0)
+			return bytes ? bytes : -EFAULT;
+		iov_iter_advance(data, bytes);
+
+		send->nr_pages += DIV_ROUND_UP(start + bytes, PAGE_SIZE);
+		for (i = first; i < send->nr_pages; i++) {
+			size_t chunk = min_t(size_t, bytes, PAGE_SIZE - start);
+
+			sg_set_page(sg, send->pages[i], chunk, start);
+			last = sg;
+			sg = sg_next(sg);
+			bytes -= chunk;
+			start = 0;
+		}
+	}
+
+	if (!last)
+		return -EFAULT;
+	sg_mark_end(last);
+
+	return 0;
+}
+
+static void virtwl_put_files(struct file **files)
+{
+	int i;
+
+	for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; i++) {
+		if (!files[i])
+			break;
+		fput(files[i]);
+		files[i] = NULL;
+	}
+}
+
+/* Called from vq_out_work_handler for sends on async contexts. */
+static void vfd_send_finish(struct virtwl_out_req *req)
+{
+	struct virtwl_send *send = container_of(req, struct virtwl_send, req);
+	struct virtwl_vfd *vfd = send->vfd;
+	int ret = virtwl_resp_err(send->ctrl_send.hdr.type);
+
+	if (ret) {
+		printk("virtwl: async send on vfd id %u failed: %d\n", vfd->id,
+		       ret);
+		if (!cmpxchg(&vfd->send_err, 0, ret))
+			wake_up_interruptible_poll(&vfd->out_waitq, POLLERR);
+	}
+
+	/* from a worker, fput leaves releasing the last reference for later */
+	virtwl_put_files(send->vfd_files);
+	virtwl_send_free(send);
+	/* this must be the last access to vfd, which may be closed after */
+	atomic_dec(&vfd->sends_in_flight);
+}
+
+/*
+ * Builds a VIRTIO_WL_CMD_VFD_SEND for vfd. The returned send is ready to be
+ * queued on the out vq. A send that was queued must not be touched again
+ * unless it is synchronous, in which case it is finished with
+ * virtwl_send_wait(). One that could not be queued is released with
+ * virtwl_send_abort().
+ */
+static struct virtwl_send *virtwl_send_alloc(struct virtwl_vfd *vfd,
+					     struct iov_iter *data,
+					     int *vfd_fds)
+{
+	size_t len = iov_iter_count(data);
+	struct file *vfd_files[VIRTWL_SEND_MAX_ALLOCS] = { 0 };
+	struct virtwl_vfd *vfds[VIRTWL_SEND_MAX_ALLOCS] = { 0 };
+	size_t vfd_count = 0;
+	size_t post_send_size;
+	struct virtwl_send *send;
+	struct virtio_wl_ctrl_vfd_send *ctrl_send;
+	__le32 *vfd_ids;
+	u8 *out_buffer;
+	/*
+	 * The user may reuse the buffer as soon as an async send returns, so
+	 * only synchronous sends can leave the payload in user pages.
+	 */
+	bool zerocopy = !vfd->async_send && len &&
+			send_zerocopy_threshold &&
+			len >= send_zerocopy_threshold;
+	int ret;
+	int i;
+
+	/* report a failure of an earlier async send before sending anything */
+	if (vfd->async_send) {
+		ret = xchg(&vfd->send_err, 0);
+		if (ret)
+			return ERR_PTR(ret);
+	}
+
+	if (vfd_fds) {
+		for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; i++) {
+			struct file *vfd_file;
+			int fd = vfd_fds[i];
+			if (fd < 0)
+				break;
+
+			vfd_file = fget(vfd_fds[i]);
+			if (!vfd_file) {
+				ret = -EBADFD;
+				goto put_files;
+			}
+			vfd_files[i] = vfd_file;
+
+			if (vfd_file->f_op != &virtwl_vfd_fops) {
+				ret = -EINVAL;
+				goto put_files;
+			}
+
+			vfds[i] = vfd_file->private_data;
+			if (!vfds[i] || !vfds[i]->id) {
+				ret = -EINVAL;
+				goto put_files;
+			}
+			/* the host may hold on to it after we close it */
+			WRITE_ONCE(vfds[i]->shared, true);
+
+			vfd_count++;
+		}
+	}
+
+	if (len > U32_MAX) {
+		ret = -EMSGSIZE;
+		goto put_files;
+	}
+
+	post_send_size = vfd_count * sizeof(__le32) + (zerocopy ? 0 : len);
+	send = virtwl_cmd_alloc(vfd->vi, sizeof(*send) + post_send_size);
+	if (!send) {
+		ret = -ENOMEM;
+		goto put_files;
+	}
+	send->alloc_size = sizeof(*send) + post_send_size;
+	send->vfd = vfd;
+	send->len = len;
+	ctrl_send = &send->ctrl_send;
+
+	vfd_ids = (__le32 *)((u8*)ctrl_send + sizeof(*ctrl_send));
+	out_buffer = (u8*)vfd_ids + vfd_count * sizeof(__le32);
+
+	ctrl_send->hdr.type = VIRTIO_WL_CMD_VFD_SEND;
+	ctrl_send->vfd_id = vfd->id;
+	ctrl_send->vfd_count = vfd_count;
+	for (i = 0; i < vfd_count; i++) {
+		vfd_ids[i] = cpu_to_le32(vfds[i]->id);
+	}
+
+	sg_init_one(&send->out_sg, ctrl_send,
+		    sizeof(*ctrl_send) + post_send_size);
+	sg_init_one(&send->in_sg, ctrl_send, sizeof(struct virtio_wl_ctrl_hdr));
+	send->out_sgs = 0;
+	send->sgs[send->out_sgs++] = &send->out_sg;
 
-	mutex_lock(vq_lock);
-	while ((finish_completion = virtqueue_get_buf(vq, &len)) != NULL) {
-		wake_waitq = true;
-		complete(finish_completion);
+	if (zerocopy) {
+		ret = virtwl_send_pin(send, data);
+		if (ret)
+			goto free_send;
+		send->sgs[send->out_sgs++] = send->data_sgt.sgl;
+	} else if (copy_from_iter(out_buffer, len, data) != len) {
+		ret = -EFAULT;
+		goto free_send;
 	}
-	mutex_unlock(vq_lock);
+	send->sgs[send->out_sgs] = &send->in_sg;
 
-	if (wake_waitq)
-		wake_up_interruptible(&vi->out_waitq);
-}
+	virtwl_out_req_init(&send->req,
+			    vfd->async_send ? vfd_send_finish : NULL);
+	memcpy(send->vfd_files, vfd_files, sizeof(vfd_files));
 
-static void vq_in_cb(struct virtqueue *vq)
-{
-	struct virtwl_info *vi = vq->vdev->priv;
-	schedule_work(&vi->in_vq_work);
+	if (vfd->async_send)
+		atomic_inc(&vfd->sends_in_flight);
+
+	return send;
+
+free_send:
+	virtwl_send_free(send);
+put_files:
+	virtwl_put_files(vfd_files);
+	return ERR_PTR(ret);
 }
 
-static void vq_out_cb(struct virtqueue *vq)
+/* Releases a send that could not be queued. */
+static void virtwl_send_abort(struct virtwl_send *send)
 {
-	struct virtwl_info *vi = vq->vdev->priv;
-	schedule_work(&vi->out_vq_work);
+	virtwl_put_files(send->vfd_files);
+	if (send->vfd->async_send)
+		atomic_dec(&send->vfd->sends_in_flight);
+	virtwl_send_free(send);
 }
 
-static struct virtwl_vfd *virtwl_vfd_alloc(struct virtwl_info *vi)
+/* Waits for a queued synchronous send to finish and releases it. */
+static int virtwl_send_wait(struct virtwl_send *send)
 {
-	struct virtwl_vfd *vfd = kzalloc(sizeof(struct virtwl_vfd), GFP_KERNEL);
-	if (!vfd)
-		return ERR_PTR(-ENOMEM);
-
-	vfd->vi = vi;
+	int ret;
 
-	mutex_init(&vfd->lock);
-	INIT_LIST_HEAD(&vfd->in_queue);
-	init_waitqueue_head(&vfd->in_waitq);
+	vq_out_busy_poll(send->vfd->qp, &send->req.finish_completion);
+	wait_for_completion(&send->req.finish_completion);
+	ret = virtwl_resp_err(send->ctrl_send.hdr.type);
+	virtwl_put_files(send->vfd_files);
+	virtwl_send_free(send);
 
-	return vfd;
+	return ret;
 }
 
-/* Locks the vfd and unlinks its id from vi */
-static void virtwl_vfd_lock_unlink(struct virtwl_vfd *vfd)
+static void virtwl_stat_send(struct virtwl_vfd *vfd, size_t len,
+			     u32 vfd_count)
 {
-	struct virtwl_info *vi = vfd->vi;
-	/* this order is important to avoid deadlock */
-	mutex_lock(&vi->vfds_lock);
-	mutex_lock(&vfd->lock);
-	idr_remove(&vi->vfds, vfd->id);
-	mutex_unlock(&vi->vfds_lock);
+	virtwl_stat_add(vfd->vi, vfd, VIRTWL_STAT_MSGS_SENT, 1);
+	virtwl_stat_add(vfd->vi, vfd, VIRTWL_STAT_BYTES_SENT, len);
+	virtwl_stat_add(vfd->vi, vfd, VIRTWL_STAT_VFDS_SENT, vfd_count);
 }
 
-/*
- * Only used to free a vfd that is not referenced any place else and contains
- * no queed virtio buffers. This must not be called while vfd is included in a
- * vi->vfd.
- */
-static void virtwl_vfd_free(struct virtwl_vfd *vfd)
+static int do_send(struct virtwl_vfd *vfd, struct iov_iter *data, int *vfd_fds,
+		   bool nonblock)
 {
-	kfree(vfd);
-}
+	struct virtwl_send *send;
+	u32 vfd_count;
+	size_t len;
+	bool async;
+	int ret;
 
-/*
- * Thread safe and also removes vfd from vi as well as any queued virtio buffers
- */
-static void virtwl_vfd_remove(struct virtwl_vfd *vfd)
-{
-	struct virtwl_info *vi = vfd->vi;
-	struct virtqueue *vq = vi->vqs[VIRTWL_VQ_IN];
-	struct mutex *vq_lock = &vi->vq_locks[VIRTWL_VQ_IN];
-	struct virtwl_vfd_qentry *qentry, *next;
-	virtwl_vfd_lock_unlink(vfd);
+	send = virtwl_send_alloc(vfd, data, vfd_fds);
+	if (IS_ERR(send))
+		return PTR_ERR(send);
 
-	mutex_lock(vq_lock);
-	list_for_each_entry_safe(qentry, next, &vfd->in_queue, list) {
-		vq_return_inbuf_locked(vq, qentry->hdr);
-		list_del(&qentry->list);
-		kfree(qentry);
+	/* an async send is only safe to look at until it's queued */
+	async = send->req.finish;
+	len = send->len;
+	vfd_count = send->ctrl_send.vfd_count;
+	ret = vq_queue_out(vfd->qp, send->sgs, send->out_sgs, 1, &send->req,
+			   nonblock);
+	if (ret) {
+		virtwl_send_abort(send);
+		return ret;
 	}
-	mutex_unlock(vq_lock);
+	virtwl_stat_send(vfd, len, vfd_count);
 
-	virtwl_vfd_free(vfd);
+	return async ? 0 : virtwl_send_wait(send);
 }
 
-static void vfd_qentry_free_if_empty(struct virtwl_vfd *vfd,
-				     struct virtwl_vfd_qentry *qentry)
+static bool virtwl_iocb_nonblock(struct kiocb *iocb)
 {
-	struct virtwl_info *vi = vfd->vi;
-	struct virtqueue *vq = vi->vqs[VIRTWL_VQ_IN];
-	struct mutex *vq_lock = &vi->vq_locks[VIRTWL_VQ_IN];
+#ifdef IOCB_NOWAIT
+	if (iocb->ki_flags & IOCB_NOWAIT)
+		return true;
+#endif
+	return iocb->ki_filp->f_flags & O_NONBLOCK;
+}
 
-	if (qentry->hdr->type == VIRTIO_WL_CMD_VFD_RECV) {
-		struct virtio_wl_ctrl_vfd_recv *recv =
-			(struct virtio_wl_ctrl_vfd_recv *)qentry->hdr;
-		ssize_t data_len =
-			(ssize_t)qentry->len - (ssize_t)sizeof(*recv) -
-			(ssize_t)recv->vfd_count * (ssize_t)sizeof(__le32);
+/*
+ * Must hold vfd->lock. Reads pending data for read_iter. Like read() on a unix
+ * socket carrying SCM_RIGHTS, any vfds that came with the data are closed.
+ * Returns 0 if nothing is pending.
+ */
+static ssize_t vfd_read_locked(struct virtwl_vfd *vfd, struct iov_iter *to)
+{
+	struct virtwl_vfd *vfds[VIRTWL_SEND_MAX_ALLOCS];
+	size_t vfd_count;
+	unsigned int tail;
+	ssize_t ret = 0;
+	size_t i;
 
-		if (qentry->vfd_offset < recv->vfd_count)
-			return;
+	/* from now on messages wait here rather than on the cq */
+	vfd->cq_disabled = true;
+
+	/* a message of only vfds must not look like end of file */
+	while (!ret && vfd_in_pending(vfd)) {
+		tail = vfd->in_tail;
+		ret = vfd_out_locked(vfd, to);
+		vfd_count = ret < 0 ? 0 :
+			    vfd_out_vfds_locked(vfd, vfds,
+						VIRTWL_SEND_MAX_ALLOCS);
+		vfd_in_retire(vfd);
+
+		for (i = 0; i < vfd_count; i++) {
+			virtwl_vfd_close_async(vfds[i]);
+			virtwl_vfd_put(vfds[i]);
+		}
 
-		if ((s64)qentry->data_offset < data_len)
-			return;
+		if (!ret && !vfd_count && vfd->in_tail == tail)
+			break;
 	}
 
-	mutex_lock(vq_lock);
-	vq_return_inbuf_locked(vq, qentry->hdr);
-	mutex_unlock(vq_lock);
-	list_del(&qentry->list);
-	kfree(qentry);
-	virtqueue_kick(vq);
+	return ret;
 }
 
-static ssize_t vfd_out_locked(struct virtwl_vfd *vfd, char __user *buffer,
-			      size_t len)
+/*
+ * Completes the AIO reads of a context: cancelled ones first, then waiting
+ * ones in order for as long as there is data. Runs on vi->wq, queued from
+ * vq_handle_recv and vfd_aio_read_cancel.
+ */
+static void vfd_aio_work_handler(struct work_struct *work)
 {
-	struct virtwl_vfd_qentry *qentry, *next;
-	ssize_t read_count = 0;
-
-	list_for_each_entry_safe(qentry, next, &vfd->in_queue, list) {
-		struct virtio_wl_ctrl_vfd_recv *recv =
-			(struct virtio_wl_ctrl_vfd_recv *)qentry->hdr;
-		size_t recv_offset = sizeof(*recv) + recv->vfd_count *
-				     sizeof(__le32) + qentry->data_offset;
-		u8 *buf = (u8 *)recv + recv_offset;
-		ssize_t to_read = (ssize_t)qentry->len - (ssize_t)recv_offset;
-		if (read_count >= len)
-			break;
-		if (to_read <= 0)
-			continue;
-		if (qentry->hdr->type != VIRTIO_WL_CMD_VFD_RECV)
-			continue;
-
-		if ((to_read + read_count) > len)
-			to_read = len - read_count;
+	struct virtwl_vfd *vfd = container_of(work, struct virtwl_vfd,
+					      aio_work);
+	struct virtwl_aio_read *aio, *tmp;
+	LIST_HEAD(done);
 
-		if (copy_to_user(buffer + read_count, buf, to_read)) {
-			/* return error unless we have some data to return */
-			if (read_count == 0)
-				read_count = -EFAULT;
+	mutex_lock(&vfd->lock);
+	spin_lock_irq(&vfd->aio_lock);
+	list_for_each_entry(aio, &vfd->aio_cancelled, node)
+		aio->ret = -ECANCELED;
+	list_splice_init(&vfd->aio_cancelled, &done);
+
+	while (vfd_in_pending(vfd) && !list_empty(&vfd->aio_reads)) {
+		aio = list_first_entry(&vfd->aio_reads,
+				       struct virtwl_aio_read, node);
+		list_move_tail(&aio->node, &done);
+		spin_unlock_irq(&vfd->aio_lock);
+
+		if (aio->mm)
+			use_mm(aio->mm);
+		aio->ret = vfd_read_locked(vfd, &aio->to);
+		if (aio->mm)
+			unuse_mm(aio->mm);
+
+		spin_lock_irq(&vfd->aio_lock);
+		/* only vfds were pending, which must not look like end of file */
+		if (!aio->ret) {
+			list_move(&aio->node, &vfd->aio_reads);
 			break;
 		}
-
-		read_count += to_read;
-
-		qentry->data_offset += to_read;
-		vfd_qentry_free_if_empty(vfd, qentry);
 	}
+	spin_unlock_irq(&vfd->aio_lock);
+	mutex_unlock(&vfd->lock);
 
-	return read_count;
+	list_for_each_entry_safe(aio, tmp, &done, node) {
+		aio->iocb->ki_complete(aio->iocb, aio->ret, 0);
+		kfree(aio->iov);
+		kfree(aio);
+	}
 }
 
-/* must hold both vfd->lock and vi->vfds_lock */
-static size_t vfd_out_vfds_locked(struct virtwl_vfd *vfd,
-				  struct virtwl_vfd **vfds, size_t count)
+/*
+ * Called by the aio core with its context lock held, so the read is only moved
+ * to aio_cancelled here and completed by vfd_aio_work_handler.
+ */
+static int vfd_aio_read_cancel(struct kiocb *iocb)
 {
-	struct virtwl_info *vi = vfd->vi;
-	struct virtwl_vfd_qentry *qentry, *next;
-	size_t i;
-	size_t read_count = 0;
-
-	list_for_each_entry_safe(qentry, next, &vfd->in_queue, list) {
-		struct virtio_wl_ctrl_vfd_recv *recv =
-			(struct virtio_wl_ctrl_vfd_recv *)qentry->hdr;
-		size_t vfd_offset = sizeof(*recv) + qentry->vfd_offset *
-				    sizeof(__le32);
-		__le32 *vfds_le = (__le32 *)((void *)recv + vfd_offset);
-		ssize_t vfds_to_read = recv->vfd_count - qentry->vfd_offset;
-		if (read_count >= count)
+	struct virtwl_vfd *vfd = iocb->ki_filp->private_data;
+	struct virtwl_aio_read *aio;
+	unsigned long flags;
+	int ret = -EINVAL;
+
+	spin_lock_irqsave(&vfd->aio_lock, flags);
+	list_for_each_entry(aio, &vfd->aio_reads, node) {
+		if (aio->iocb == iocb) {
+			list_move_tail(&aio->node, &vfd->aio_cancelled);
+			ret = 0;
 			break;
-		if (vfds_to_read <= 0)
-			continue;
-		if (qentry->hdr->type != VIRTIO_WL_CMD_VFD_RECV)
-			continue;
-
-		if ((vfds_to_read + read_count) > count)
-			vfds_to_read = count - read_count;
-
-		for (i = 0; i < vfds_to_read; i++) {
-			uint32_t vfd_id = le32_to_cpu(vfds_le[i]);
-			vfds[read_count] = idr_find(&vi->vfds, vfd_id);
-			if (vfds[read_count]) {
-				read_count++;
-			} else {
-				printk("virtwl: received a vfd with unrecognized id: %u\n",
-				       vfd_id);
-			}
-			qentry->vfd_offset++;
 		}
-
-		vfd_qentry_free_if_empty(vfd, qentry);
 	}
+	spin_unlock_irqrestore(&vfd->aio_lock, flags);
 
-	return read_count;
+	if (!ret)
+		queue_work(vfd->vi->wq, &vfd->aio_work);
+
+	return ret;
 }
 
-/* this can only be called if the caller has unique ownership of the vfd */
-static int do_vfd_close(struct virtwl_vfd *vfd)
+/* Must hold vfd->lock. Parks an AIO read until the host sends data. */
+static ssize_t vfd_aio_read_queue(struct virtwl_vfd *vfd, struct kiocb *iocb,
+				  struct iov_iter *to)
 {
-	struct virtio_wl_ctrl_vfd *ctrl_close;
-	struct virtwl_info *vi = vfd->vi;
-	struct completion finish_completion;
-	struct scatterlist out_sg;
-	struct scatterlist in_sg;
-	int ret = 0;
+	struct virtwl_aio_read *aio;
 
-	ctrl_close = kzalloc(sizeof(*ctrl_close), GFP_KERNEL);
-	if (!ctrl_close)
+	aio = kzalloc(sizeof(*aio), GFP_KERNEL);
+	if (!aio)
 		return -ENOMEM;
 
-	ctrl_close->hdr.type = VIRTIO_WL_CMD_VFD_CLOSE;
-	ctrl_close->vfd_id = vfd->id;
-
-	sg_init_one(&in_sg, &ctrl_close->hdr, sizeof(struct virtio_wl_ctrl_vfd));
-	sg_init_one(&out_sg, &ctrl_close->hdr, sizeof(struct virtio_wl_ctrl_hdr));
-
-	init_completion(&finish_completion);
-	ret = vq_queue_out(vi, &out_sg, &in_sg, &finish_completion,
-			   false /* block */);
-	if (ret) {
-		printk("virtwl: failed to queue close vfd id %u: %d\n", vfd->id,
-		       ret);
-		goto free_ctrl_close;
+	/* the caller's iovec array is gone once read_iter returns */
+	aio->iov = dup_iter(&aio->to, to, GFP_KERNEL);
+	if (!aio->iov) {
+		kfree(aio);
+		return -ENOMEM;
 	}
+	aio->iocb = iocb;
+	aio->mm = current->mm;
 
-	wait_for_completion(&finish_completion);
-	virtwl_vfd_remove(vfd);
+	kiocb_set_cancel_fn(iocb, vfd_aio_read_cancel);
+	spin_lock_irq(&vfd->aio_lock);
+	list_add_tail(&aio->node, &vfd->aio_reads);
+	spin_unlock_irq(&vfd->aio_lock);
 
-free_ctrl_close:
-	kfree(ctrl_close);
-	return ret;
+	return -EIOCBQUEUED;
 }
 
-static ssize_t virtwl_vfd_recv(struct file *filp, char __user *buffer,
-			       size_t len, struct virtwl_vfd **vfds,
-			       size_t *vfd_count)
+/*
+ * Reads the data of a context. Without data, an AIO read is parked and
+ * completed from the in vq path instead of blocking the submitter.
+ */
+static ssize_t virtwl_vfd_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct virtwl_vfd *vfd = filp->private_data;
-	struct virtwl_info *vi = vfd->vi;
-	ssize_t read_count = 0;
-	size_t vfd_read_count = 0;
-
-	mutex_lock(&vi->vfds_lock);
-	mutex_lock(&vfd->lock);
+	struct virtwl_vfd *vfd = iocb->ki_filp->private_data;
+	bool nonblock = virtwl_iocb_nonblock(iocb);
+	ssize_t ret;
 
-	while (read_count == 0 && vfd_read_count == 0) {
-		while (list_empty(&vfd->in_queue)) {
-			mutex_unlock(&vfd->lock);
-			mutex_unlock(&vi->vfds_lock);
-			if (filp->f_flags & O_NONBLOCK)
-				return -EAGAIN;
+	if (!(vfd->flags & VIRTIO_WL_VFD_CONTROL))
+		return -EINVAL;
 
-			if (wait_event_interruptible(vfd->in_waitq,
-				!list_empty(&vfd->in_queue)))
-				return -ERESTARTSYS;
+	if (!iov_iter_count(to))
+		return 0;
 
-			mutex_lock(&vi->vfds_lock);
-			mutex_lock(&vfd->lock);
+	mutex_lock(&vfd->lock);
+	while (!(ret = vfd_read_locked(vfd, to))) {
+		if (!is_sync_kiocb(iocb) && !nonblock) {
+			ret = vfd_aio_read_queue(vfd, iocb, to);
+			break;
 		}
 
-		read_count = vfd_out_locked(vfd, buffer, len);
-		if (read_count < 0)
-			goto out_unlock;
-		if (vfds && vfd_count && *vfd_count)
-			vfd_read_count = vfd_out_vfds_locked(vfd, vfds,
-							     *vfd_count);
-	}
+		mutex_unlock(&vfd->lock);
+		if (nonblock)
+			return -EAGAIN;
 
-	*vfd_count = vfd_read_count;
+		if (wait_event_interruptible(vfd->in_waitq,
+			READ_ONCE(vfd->in_head) != READ_ONCE(vfd->in_tail)))
+			return -ERESTARTSYS;
 
-out_unlock:
+		mutex_lock(&vfd->lock);
+	}
 	mutex_unlock(&vfd->lock);
-	mutex_unlock(&vi->vfds_lock);
-	return read_count;
+
+	return ret;
 }
 
-static int virtwl_vfd_mmap(struct file *filp, struct vm_area_struct *vma)
+/* Called from vq_out_work_handler for AIO writes. */
+static void vfd_aio_send_finish(struct virtwl_out_req *req)
 {
-	struct virtwl_vfd *vfd = filp->private_data;
-	unsigned long vm_size = vma->vm_end - vma->vm_start;
-	int ret = 0;
+	struct virtwl_send *send = container_of(req, struct virtwl_send, req);
+	struct kiocb *iocb = send->iocb;
+	long ret = virtwl_resp_err(send->ctrl_send.hdr.type);
+
+	/* counted here since the write may not look at the vfd once queued */
+	if (!ret) {
+		ret = send->len;
+		virtwl_stat_send(send->vfd, send->len, 0);
+	}
+	virtwl_send_free(send);
+	/* this may drop the last reference on the file */
+	iocb->ki_complete(iocb, ret, 0);
+}
 
-	mutex_lock(&vfd->lock);
+/*
+ * Sends the data as one message without vfds. An AIO write returns once the
+ * message is queued and completes when the host has taken it.
+ */
+static ssize_t virtwl_vfd_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct virtwl_vfd *vfd = iocb->ki_filp->private_data;
+	bool aio = !is_sync_kiocb(iocb) && !vfd->async_send;
+	size_t len = iov_iter_count(from);
+	struct virtwl_send *send;
+	int ret;
 
-	if (!(vfd->flags & VIRTIO_WL_VFD_MAP)) {
-		ret = -EACCES;
-		goto out_unlock;
-	}
+	if (!(vfd->flags & VIRTIO_WL_VFD_CONTROL))
+		return -EINVAL;
 
-	if ((vma->vm_flags & VM_WRITE) && !(vfd->flags & VIRTIO_WL_VFD_WRITE)) {
-		ret = -EACCES;
-		goto out_unlock;
+	if (!len)
+		return 0;
+
+	send = virtwl_send_alloc(vfd, from, NULL);
+	if (IS_ERR(send))
+		return PTR_ERR(send);
+
+	if (aio) {
+		send->iocb = iocb;
+		send->req.finish = vfd_aio_send_finish;
 	}
 
-	if (vm_size + (vma->vm_pgoff << PAGE_SHIFT) > PAGE_ALIGN(vfd->size)) {
-		ret = -EINVAL;
-		goto out_unlock;
+	ret = vq_queue_out(vfd->qp, send->sgs, send->out_sgs, 1, &send->req,
+			   virtwl_iocb_nonblock(iocb));
+	if (ret) {
+		virtwl_send_abort(send);
+		return ret;
 	}
 
-	ret = io_remap_pfn_range(vma, vma->vm_start, vfd->pfn, vm_size,
-				 vma->vm_page_prot);
-	if (ret)
-		goto out_unlock;
+	/*
+	 * vfd_aio_send_finish may have completed the iocb already and dropped
+	 * the last reference on the vfd with it.
+	 */
+	if (aio)
+		return -EIOCBQUEUED;
 
-	vma->vm_flags |= VM_PFNMAP | VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+	virtwl_stat_send(vfd, len, 0);
+	if (vfd->async_send)
+		return len;
 
-out_unlock:
-	mutex_unlock(&vfd->lock);
-	return ret;
+	ret = virtwl_send_wait(send);
+
+	return ret ? ret : len;
 }
 
-static unsigned int virtwl_vfd_poll(struct file *filp,
-				    struct poll_table_struct *wait)
+/*
+ * Sends every txn in the batch with a single kick of each out vq used. Like
+ * sendmmsg, this returns the number of txns sent, or an error if none were.
+ */
+static long virtwl_ioctl_send_batch(struct file *filp, void __user *ptr)
 {
-	struct virtwl_vfd *vfd = filp->private_data;
-	struct virtwl_info *vi = vfd->vi;
-	unsigned int mask = 0;
-
-	mutex_lock(&vi->vq_locks[VIRTWL_VQ_OUT]);
-	poll_wait(filp, &vi->out_waitq, wait);
-	if (vi->vqs[VIRTWL_VQ_OUT]->num_free)
-		mask |= POLLOUT | POLLWRNORM;
-	mutex_unlock(&vi->vq_locks[VIRTWL_VQ_OUT]);
+	struct virtwl_vq_pair *qp = NULL;
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	struct virtwl_ioctl_send_batch batch;
+	struct virtwl_ioctl_batch_txn __user *user_txns;
+	struct virtwl_send **sends;
+	struct file **ctx_files;
+	u32 prepared;
+	u32 queued;
+	u32 i;
+	int host_err = 0;
+	int ret = 0;
+	int err;
 
-	mutex_lock(&vfd->lock);
-	poll_wait(filp, &vfd->in_waitq, wait);
-	if (!list_empty(&vfd->in_queue))
-		mask |= POLLIN | POLLRDNORM;
-	mutex_unlock(&vfd->lock);
+	if (copy_from_user(&batch, ptr, sizeof(batch)))
+		return -EFAULT;
 
-	return mask;
-}
+	if (!batch.count || batch.count > VIRTWL_SEND_BATCH_MAX)
+		return -EINVAL;
 
-static int virtwl_vfd_release(struct inode *inodep, struct file *filp)
-{
-	struct virtwl_vfd *vfd = filp->private_data;
-	uint32_t vfd_id = vfd->id;
+	user_txns = u64_to_user_ptr(batch.txns);
 
-	/*
-	 * if release is called, filp must be out of references and we have the
-	 * last reference
-	 */
-	int ret = do_vfd_close(vfd);
-	if (ret)
-		printk("virtwl: failed to release vfd id %u: %d\n", vfd_id,
-		       ret);
-	return 0;
-}
+	sends = kcalloc(batch.count, sizeof(*sends), GFP_KERNEL);
+	ctx_files = kcalloc(batch.count, sizeof(*ctx_files), GFP_KERNEL);
+	if (!sends || !ctx_files) {
+		ret = -ENOMEM;
+		goto free_arrays;
+	}
 
-static int virtwl_open(struct inode *inodep, struct file *filp)
-{
-	struct virtwl_info *vi = container_of(inodep->i_cdev,
-					      struct virtwl_info, cdev);
+	/* a txn that can't be built ends the batch, like a short sendmmsg */
+	for (prepared = 0; prepared < batch.count; prepared++) {
+		struct virtwl_ioctl_batch_txn txn;
+		struct file *ctx_file;
+		struct virtwl_send *send;
+		struct iovec iov;
+		struct iov_iter data;
 
-	filp->private_data = vi;
+		if (copy_from_user(&txn, &user_txns[prepared], sizeof(txn))) {
+			ret = -EFAULT;
+			break;
+		}
 
-	return 0;
-}
+		ret = import_single_range(WRITE, u64_to_user_ptr(txn.data),
+					  txn.len, &iov, &data);
+		if (ret)
+			break;
 
-static int do_send(struct virtwl_vfd *vfd, const char __user *buffer, u32 len,
-		   int *vfd_fds, bool nonblock)
-{
-	struct virtwl_info *vi = vfd->vi;
-	struct fd vfd_files[VIRTWL_SEND_MAX_ALLOCS] = { { 0 } };
-	struct virtwl_vfd *vfds[VIRTWL_SEND_MAX_ALLOCS] = { 0 };
-	size_t vfd_count = 0;
-	size_t post_send_size;
-	struct virtio_wl_ctrl_vfd_send *ctrl_send;
-	__le32 *vfd_ids;
-	u8 *out_buffer;
-	unsigned long remaining;
-	struct completion finish_completion;
-	struct scatterlist out_sg;
-	struct scatterlist in_sg;
-	int ret;
-	int i;
+		ctx_file = fget(txn.fd);
+		if (!ctx_file) {
+			ret = -EBADF;
+			break;
+		}
+		if (ctx_file->f_op != &virtwl_vfd_fops) {
+			fput(ctx_file);
+			ret = -EINVAL;
+			break;
+		}
 
-	if (vfd_fds) {
-		for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; i++) {
-			struct fd vfd_file;
-			int fd = vfd_fds[i];
-			if (fd < 0)
-				break;
+		send = virtwl_send_alloc(ctx_file->private_data, &data,
+					 txn.fds);
+		if (IS_ERR(send)) {
+			fput(ctx_file);
+			ret = PTR_ERR(send);
+			break;
+		}
 
-			vfd_file = fdget(vfd_fds[i]);
-			if (!vfd_file.file) {
-				ret = -EBADFD;
-				goto put_files;
-			}
-			vfd_files[i] = vfd_file;
+		ctx_files[prepared] = ctx_file;
+		sends[prepared] = send;
+	}
 
-			if (vfd_file.file->f_op != &virtwl_vfd_fops) {
-				ret = -EINVAL;
-				goto put_files;
-			}
+	/* consecutive txns on the same queue pair share one kick */
+	for (queued = 0; queued < prepared; queued++) {
+		struct virtwl_send *send = sends[queued];
 
-			vfds[i] = vfd_file.file->private_data;
-			if (!vfds[i] || !vfds[i]->id) {
-				ret = -EINVAL;
-				goto put_files;
+		if (send->vfd->qp != qp) {
+			if (qp) {
+				vq_kick(qp, VIRTWL_VQ_OUT);
+				mutex_unlock(&qp->vq_locks[VIRTWL_VQ_OUT]);
 			}
+			qp = send->vfd->qp;
+			mutex_lock(&qp->vq_locks[VIRTWL_VQ_OUT]);
+		}
 
-			vfd_count++;
+		err = vq_add_out_locked(qp, send->sgs, send->out_sgs, 1,
+					&send->req, nonblock);
+		if (err) {
+			ret = err;
+			break;
 		}
+		/* the vq lock keeps the send from finishing for now */
+		virtwl_stat_send(send->vfd, send->len,
+				 send->ctrl_send.vfd_count);
 	}
-
-	post_send_size = vfd_count * sizeof(__le32) + len;
-	ctrl_send = kzalloc(sizeof(*ctrl_send) + post_send_size, GFP_KERNEL);
-	if (!ctrl_send) {
-		ret = -ENOMEM;
-		goto put_files;
+	if (qp) {
+		/* kicking with nothing new added is harmless */
+		vq_kick(qp, VIRTWL_VQ_OUT);
+		mutex_unlock(&qp->vq_locks[VIRTWL_VQ_OUT]);
 	}
 
-	vfd_ids = (__le32 *)((u8*)ctrl_send + sizeof(*ctrl_send));
-	out_buffer = (u8*)vfd_ids + vfd_count * sizeof(__le32);
-
-	ctrl_send->hdr.type = VIRTIO_WL_CMD_VFD_SEND;
-	ctrl_send->vfd_id = vfd->id;
-	ctrl_send->vfd_count = vfd_count;
-	for (i = 0; i < vfd_count; i++) {
-		vfd_ids[i] = cpu_to_le32(vfds[i]->id);
+	for (i = 0; i < prepared; i++) {
+		struct virtwl_vfd *vfd = ctx_files[i]->private_data;
+
+		/* queued async sends may have been freed already */
+		if (i >= queued) {
+			virtwl_send_abort(sends[i]);
+		} else if (!vfd->async_send) {
+			err = virtwl_send_wait(sends[i]);
+			/* the host failing a queued send fails the batch */
+			if (err && !host_err)
+				host_err = err;
+		}
+		fput(ctx_files[i]);
 	}
 
-	remaining = copy_from_user(out_buffer, buffer, len);
-	if (remaining)
-		goto free_ctrl_send;
+	if (host_err)
+		ret = host_err;
+	else if (queued)
+		ret = queued;
 
-	init_completion(&finish_completion);
-	sg_init_one(&out_sg, ctrl_send, sizeof(*ctrl_send) + post_send_size);
-	sg_init_one(&in_sg, ctrl_send, sizeof(struct virtio_wl_ctrl_hdr));
+free_arrays:
+	kfree(ctx_files);
+	kfree(sends);
+	return ret;
+}
 
-	ret = vq_queue_out(vi, &out_sg, &in_sg, &finish_completion, nonblock);
-	if (ret)
-		goto free_ctrl_send;
+/* A VIRTIO_WL_CMD_VFD_NEW or _NEW_CTX for a vfd whose id is reserved. */
+struct virtwl_new {
+	struct virtwl_out_req req;
+	struct virtwl_vfd *vfd; /* not in vi->vfds until virtwl_new_finish() */
+	struct scatterlist out_sg;
+	struct scatterlist in_sg;
+	struct scatterlist *sgs[2];
+	u64 start_ns;
+	struct virtio_wl_ctrl_vfd_new ctrl_new;
+};
 
-	wait_for_completion(&finish_completion);
+static int virtwl_new_check(uint32_t type, uint32_t flags)
+{
+	if (type != VIRTWL_IOCTL_NEW_CTX && type != VIRTWL_IOCTL_NEW_ALLOC)
+		return -EINVAL;
 
-	ret = virtwl_resp_err(ctrl_send->hdr.type);
+	if (flags & ~(type == VIRTWL_IOCTL_NEW_CTX ?
+		      VIRTWL_IOCTL_NEW_CTX_FLAGS : VIRTWL_IOCTL_NEW_ALLOC_FLAGS))
+		return -EINVAL;
 
-free_ctrl_send:
-	kfree(ctrl_send);
-put_files:
-	for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; i++) {
-		if (!vfd_files[i].file)
-			continue;
-		fdput(vfd_files[i]);
-	}
-	return ret;
+	if ((flags & VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK) ==
+	    VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK)
+		return -EINVAL;
+
+	return 0;
 }
 
-static struct virtwl_vfd *do_new(struct virtwl_info *vi, uint32_t type,
-				 uint32_t size, bool nonblock)
+/*
+ * Allocates a vfd and its id and builds the command that creates it on the
+ * host. The returned new must be queued on new->vfd->qp and then passed to
+ * virtwl_new_finish(), or passed there directly with the error that kept it
+ * from being queued.
+ */
+static struct virtwl_new *virtwl_new_prepare(struct virtwl_info *vi,
+					     uint32_t type, uint32_t flags,
+					     uint32_t size)
 {
 	struct virtio_wl_ctrl_vfd_new *ctrl_new;
+	struct virtwl_new *new;
 	struct virtwl_vfd *vfd;
-	struct completion finish_completion;
-	struct scatterlist out_sg;
-	struct scatterlist in_sg;
 	int ret = 0;
 
-	if (type != VIRTWL_IOCTL_NEW_CTX && type != VIRTWL_IOCTL_NEW_ALLOC)
-		return ERR_PTR(-EINVAL);
-
-	ctrl_new = kzalloc(sizeof(*ctrl_new), GFP_KERNEL);
-	if (!ctrl_new)
+	new = virtwl_cmd_alloc(vi, sizeof(*new));
+	if (!new)
 		return ERR_PTR(-ENOMEM);
+	ctrl_new = &new->ctrl_new;
 
 	vfd = virtwl_vfd_alloc(vi);
 	if (!vfd) {
 		ret = -ENOMEM;
-		goto free_ctrl_new;
+		goto free_new;
 	}
 
 	/*
-	 * Take the lock before adding it to the vfds list where others might
-	 * reference it.
+	 * Only reserve the id, so nobody can look the vfd up before the host
+	 * has created it and virtwl_new_finish() has filled it in.
 	 */
-	mutex_lock(&vfd->lock);
-
 	mutex_lock(&vi->vfds_lock);
-	ret = idr_alloc(&vi->vfds, vfd, 1, VIRTWL_MAX_ALLOC, GFP_KERNEL);
+	ret = idr_alloc(&vi->vfds, NULL, 1, vi->max_vfd_id, GFP_KERNEL);
 	mutex_unlock(&vi->vfds_lock);
 	if (ret <= 0)
 		goto free_vfd;
 
 	vfd->id = ret;
-	ret = 0;
+	new->vfd = vfd;
 
 	ctrl_new->vfd_id = vfd->id;
 	switch (type) {
@@ -822,26 +3327,58 @@ static struct virtwl_vfd *do_new(struct virtwl_info *vi, uint32_t type,
 		ctrl_new->hdr.type = VIRTIO_WL_CMD_VFD_NEW_CTX;
 		ctrl_new->flags = VIRTIO_WL_VFD_CONTROL;
 		ctrl_new->size = 0;
+		vfd->async_send = flags & VIRTWL_IOCTL_NEW_CTX_ASYNC_SEND;
+		/* a context without its own stats still counts for the device */
+		vfd->stats = alloc_percpu(struct virtwl_stats);
+		/* the host binds the context to the qp this is sent on */
+		vfd->qp = &vi->qps[(unsigned int)atomic_inc_return(&vi->next_qp) %
+				   vi->qp_count];
 		break;
 	case VIRTWL_IOCTL_NEW_ALLOC:
 		ctrl_new->hdr.type = VIRTIO_WL_CMD_VFD_NEW;
 		ctrl_new->flags = VIRTIO_WL_VFD_WRITE | VIRTIO_WL_VFD_MAP;
+		/* only a hint for the host, which may not manage to align it */
+		if ((flags & VIRTWL_IOCTL_NEW_ALLOC_HUGE) &&
+		    virtio_has_feature(vi->vdev, VIRTIO_WL_F_HUGE_ALIGN))
+			ctrl_new->flags |= VIRTIO_WL_VFD_HUGE_ALIGN;
 		ctrl_new->size = size;
+		vfd->caching = flags & VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK;
+		vfd->huge = flags & VIRTWL_IOCTL_NEW_ALLOC_HUGE;
 		break;
-	default:
-		ret = -EINVAL;
-		goto remove_vfd;
 	}
 
-	init_completion(&finish_completion);
-	sg_init_one(&out_sg, ctrl_new, sizeof(*ctrl_new));
-	sg_init_one(&in_sg, ctrl_new, sizeof(*ctrl_new));
+	virtwl_out_req_init(&new->req, NULL);
+	sg_init_one(&new->out_sg, ctrl_new, sizeof(*ctrl_new));
+	sg_init_one(&new->in_sg, ctrl_new, sizeof(*ctrl_new));
+	new->sgs[0] = &new->out_sg;
+	new->sgs[1] = &new->in_sg;
+	new->start_ns = ktime_get_ns();
+
+	return new;
+
+free_vfd:
+	virtwl_vfd_put(vfd);
+free_new:
+	virtwl_cmd_free(vi, new, sizeof(*new));
+	return ERR_PTR(ret);
+}
+
+/*
+ * Waits for the host to create the vfd of new if queue_ret is 0 and frees new.
+ * Returns the vfd, now in vi->vfds, or an error after removing it.
+ */
+static struct virtwl_vfd *virtwl_new_finish(struct virtwl_new *new,
+					    int queue_ret)
+{
+	struct virtio_wl_ctrl_vfd_new *ctrl_new = &new->ctrl_new;
+	struct virtwl_vfd *vfd = new->vfd;
+	struct virtwl_info *vi = vfd->vi;
+	int ret = queue_ret;
 
-	ret = vq_queue_out(vi, &out_sg, &in_sg, &finish_completion, nonblock);
 	if (ret)
 		goto remove_vfd;
 
-	wait_for_completion(&finish_completion);
+	wait_for_completion(&new->req.finish_completion);
 
 	ret = virtwl_resp_err(ctrl_new->hdr.type);
 	if (ret)
@@ -850,41 +3387,156 @@ static struct virtwl_vfd *do_new(struct virtwl_info *vi, uint32_t type,
 	vfd->size = ctrl_new->size;
 	vfd->pfn = ctrl_new->pfn;
 	vfd->flags = ctrl_new->flags;
+	trace_virtwl_new(vfd->id, vfd->flags, vfd->size, 0,
+			 ktime_get_ns() - new->start_ns);
+
+	if (vfd->flags & VIRTIO_WL_VFD_CONTROL) {
+		virtwl_stat_add(vi, NULL, VIRTWL_STAT_CTXS, 1);
+	} else {
+		virtwl_stat_add(vi, NULL, VIRTWL_STAT_ALLOCS, 1);
+		virtwl_stat_add(vi, NULL, VIRTWL_STAT_ALLOC_NS,
+				ktime_get_ns() - new->start_ns);
+	}
 
-	mutex_unlock(&vfd->lock);
+	mutex_lock(&vi->vfds_lock);
+	idr_replace(&vi->vfds, vfd, vfd->id);
+	mutex_unlock(&vi->vfds_lock);
 
-	kfree(ctrl_new);
+	virtwl_cmd_free(vi, new, sizeof(*new));
 	return vfd;
 
 remove_vfd:
-	/* unlock the vfd to avoid deadlock when unlinking it */
-	mutex_unlock(&vfd->lock);
-	virtwl_vfd_lock_unlink(vfd);
-free_vfd:
-	virtwl_vfd_free(vfd);
-free_ctrl_new:
-	kfree(ctrl_new);
+	trace_virtwl_new(vfd->id, ctrl_new->flags, ctrl_new->size, ret,
+			 ktime_get_ns() - new->start_ns);
+	mutex_lock(&vi->vfds_lock);
+	idr_remove(&vi->vfds, vfd->id);
+	mutex_unlock(&vi->vfds_lock);
+	virtwl_vfd_remove(vfd);
+	virtwl_cmd_free(vi, new, sizeof(*new));
 	return ERR_PTR(ret);
 }
 
+static struct virtwl_vfd *do_new(struct virtwl_info *vi, uint32_t type,
+				 uint32_t flags, uint32_t size, bool nonblock)
+{
+	struct virtwl_new *new;
+	struct virtwl_vfd *vfd;
+	int ret;
+
+	ret = virtwl_new_check(type, flags);
+	if (ret)
+		return ERR_PTR(ret);
+
+	/* a recycled allocation needs no round trip to the host */
+	if (type == VIRTWL_IOCTL_NEW_ALLOC) {
+		vfd = virtwl_alloc_cache_get(vi, size, flags);
+		if (vfd)
+			return vfd;
+	}
+
+	new = virtwl_new_prepare(vi, type, flags, size);
+	if (IS_ERR(new))
+		return ERR_CAST(new);
+
+	ret = vq_queue_out(new->vfd->qp, new->sgs, 1, 1, &new->req, nonblock);
+	return virtwl_new_finish(new, ret);
+}
+
 static long virtwl_ioctl_send(struct file *filp, void __user *ptr)
 {
 	struct virtwl_vfd *vfd = filp->private_data;
 	struct virtwl_ioctl_txn ioctl_send;
 	void __user *user_data = ptr + sizeof(struct virtwl_ioctl_txn);
+	struct iovec iov;
+	struct iov_iter data;
 	int ret;
 
 	ret = copy_from_user(&ioctl_send, ptr, sizeof(struct virtwl_ioctl_txn));
 	if (ret)
 		return -EFAULT;
 
-	/* Early check for user error; do_send still uses copy_from_user. */
-	ret = !access_ok(VERIFY_READ, user_data, ioctl_send.len);
+	/* Also the early check for user error. */
+	ret = import_single_range(WRITE, user_data, ioctl_send.len, &iov,
+				  &data);
+	if (ret)
+		return ret;
+
+	return do_send(vfd, &data, ioctl_send.fds, filp->f_flags & O_NONBLOCK);
+}
+
+/*
+ * Imports the user's iovec array for SENDV/RECVV. On success *iov must be
+ * kfree'd by the caller; it's NULL if the array fit on the stack.
+ */
+static int virtwl_import_txnv(int type, struct virtwl_ioctl_txnv *txnv,
+			      struct iovec *fast_iov, struct iovec **iov,
+			      struct iov_iter *iter)
+{
+	ssize_t ret;
+
+	*iov = fast_iov;
+#ifdef CONFIG_COMPAT
+	if (in_compat_syscall())
+		ret = compat_import_iovec(type, u64_to_user_ptr(txnv->iov),
+					  txnv->iovcnt, UIO_FASTIOV, iov,
+					  iter);
+	else
+#endif
+		ret = import_iovec(type, u64_to_user_ptr(txnv->iov),
+				   txnv->iovcnt, UIO_FASTIOV, iov, iter);
+
+	return ret < 0 ? ret : 0;
+}
+
+static long virtwl_ioctl_sendv(struct file *filp, void __user *ptr)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	struct virtwl_ioctl_txnv ioctl_sendv;
+	struct iovec fast_iov[UIO_FASTIOV];
+	struct iovec *iov;
+	struct iov_iter data;
+	int ret;
+
+	if (copy_from_user(&ioctl_sendv, ptr, sizeof(ioctl_sendv)))
+		return -EFAULT;
+
+	ret = virtwl_import_txnv(WRITE, &ioctl_sendv, fast_iov, &iov, &data);
 	if (ret)
+		return ret;
+
+	ret = do_send(vfd, &data, ioctl_sendv.fds, filp->f_flags & O_NONBLOCK);
+	kfree(iov);
+
+	return ret;
+}
+
+static long virtwl_ioctl_sendx(struct file *filp, void __user *ptr)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	struct virtwl_ioctl_txnx ioctl_sendx;
+	int fds[VIRTWL_SEND_MAX_ALLOCS];
+	struct iovec iov;
+	struct iov_iter data;
+	int ret;
+
+	if (copy_from_user(&ioctl_sendx, ptr, sizeof(ioctl_sendx)))
 		return -EFAULT;
 
-	return do_send(vfd, user_data, ioctl_send.len, ioctl_send.fds,
-		       filp->f_flags & O_NONBLOCK);
+	if (ioctl_sendx.fd_count > VIRTWL_SEND_MAX_ALLOCS)
+		return -EINVAL;
+
+	if (copy_from_user(fds, u64_to_user_ptr(ioctl_sendx.fds),
+			   sizeof(int) * ioctl_sendx.fd_count))
+		return -EFAULT;
+	if (ioctl_sendx.fd_count < VIRTWL_SEND_MAX_ALLOCS)
+		fds[ioctl_sendx.fd_count] = -1;
+
+	ret = import_single_range(WRITE, u64_to_user_ptr(ioctl_sendx.data),
+				  ioctl_sendx.len, &iov, &data);
+	if (ret)
+		return ret;
+
+	return do_send(vfd, &data, fds, filp->f_flags & O_NONBLOCK);
 }
 
 /* Start import of google file.c functions */
@@ -932,37 +3584,31 @@ out_unlock:
 	return -EBADF;
 }
 
-static long virtwl_ioctl_recv(struct file *filp, void __user *ptr)
+/*
+ * Receives into to and up to fd_cap VFDs, then stores the received length at
+ * user_len and the fds of the VFDs at user_fds. With user_fd_count the fds
+ * are followed by nothing and their number is stored there, otherwise all
+ * fd_cap of them are stored, padded with -1.
+ */
+static long virtwl_recv_txn(struct file *filp, struct iov_iter *to,
+			    int __user *user_fds, size_t fd_cap,
+			    __u32 __user *user_fd_count,
+			    __u32 __user *user_len)
 {
-	struct virtwl_ioctl_txn ioctl_recv;
-	void __user *user_data = ptr + sizeof(struct virtwl_ioctl_txn);
-	int __user *user_fds = (int __user *)ptr;
-	size_t vfd_count = VIRTWL_SEND_MAX_ALLOCS;
+	size_t vfd_count = fd_cap;
 	struct virtwl_vfd *vfds[VIRTWL_SEND_MAX_ALLOCS] = { 0 };
 	int fds[VIRTWL_SEND_MAX_ALLOCS];
 	size_t i;
 	int ret = 0;
 
-
 	for (i = 0; i < VIRTWL_SEND_MAX_ALLOCS; i++)
 		fds[i] = -1;
 
-	ret = copy_from_user(&ioctl_recv, ptr, sizeof(struct virtwl_ioctl_txn));
-	if (ret)
-		return -EFAULT;
-
-	/* Early check for user error. */
-	ret = !access_ok(VERIFY_WRITE, user_data, ioctl_recv.len);
-	if (ret)
-		return -EFAULT;
-
-	ret = virtwl_vfd_recv(filp, user_data, ioctl_recv.len, vfds,
-			      &vfd_count);
+	ret = virtwl_vfd_recv(filp, to, vfds, &vfd_count);
 	if (ret < 0)
 		return ret;
 
-	ret = copy_to_user(&((struct virtwl_ioctl_txn __user *)ptr)->len, &ret,
-			   sizeof(ioctl_recv.len));
+	ret = copy_to_user(user_len, &ret, sizeof(*user_len));
 	if (ret) {
 		ret = -EFAULT;
 		goto free_vfds;
@@ -971,15 +3617,22 @@ static long virtwl_ioctl_recv(struct file *filp, void __user *ptr)
 	for (i = 0; i < vfd_count; i++) {
 		ret = anon_inode_getfd("[virtwl_vfd]", &virtwl_vfd_fops,
 				       vfds[i], O_CLOEXEC | O_RDWR);
-		if (ret < 0) {
-			do_vfd_close(vfds[i]);
+		if (ret < 0)
 			goto free_vfds;
-		}
+		/* the file relies on the vfd's initial reference from here on */
+		virtwl_vfd_put(vfds[i]);
 		vfds[i] = NULL;
 		fds[i] = ret;
 	}
 
-	ret = copy_to_user(user_fds, fds, sizeof(int) * VIRTWL_SEND_MAX_ALLOCS);
+	if (user_fd_count) {
+		ret = put_user((__u32)vfd_count, user_fd_count);
+		if (ret)
+			goto free_vfds;
+		fd_cap = vfd_count;
+	}
+
+	ret = copy_to_user(user_fds, fds, sizeof(int) * fd_cap);
 	if (ret) {
 		ret = -EFAULT;
 		goto free_vfds;
@@ -989,14 +3642,300 @@ static long virtwl_ioctl_recv(struct file *filp, void __user *ptr)
 
 free_vfds:
 	for (i = 0; i < vfd_count; i++) {
-		if (vfds[i])
+		if (vfds[i]) {
 			do_vfd_close(vfds[i]);
+			virtwl_vfd_put(vfds[i]);
+		}
 		if (fds[i] >= 0)
 			__close_fd(current->files, fds[i]);
 	}
 	return ret;
 }
 
+static long virtwl_ioctl_recv(struct file *filp, void __user *ptr)
+{
+	struct virtwl_ioctl_txn __user *user_txn = ptr;
+	struct virtwl_ioctl_txn ioctl_recv;
+	void __user *user_data = ptr + sizeof(struct virtwl_ioctl_txn);
+	struct iovec iov;
+	struct iov_iter to;
+	int ret;
+
+	ret = copy_from_user(&ioctl_recv, ptr, sizeof(struct virtwl_ioctl_txn));
+	if (ret)
+		return -EFAULT;
+
+	/* Also the early check for user error. */
+	ret = import_single_range(READ, user_data, ioctl_recv.len, &iov, &to);
+	if (ret)
+		return ret;
+
+	return virtwl_recv_txn(filp, &to, user_txn->fds, VIRTWL_SEND_MAX_ALLOCS,
+			       NULL, &user_txn->len);
+}
+
+static long virtwl_ioctl_recvv(struct file *filp, void __user *ptr)
+{
+	struct virtwl_ioctl_txnv __user *user_txnv = ptr;
+	struct virtwl_ioctl_txnv ioctl_recvv;
+	struct iovec fast_iov[UIO_FASTIOV];
+	struct iovec *iov;
+	struct iov_iter to;
+	long ret;
+
+	if (copy_from_user(&ioctl_recvv, ptr, sizeof(ioctl_recvv)))
+		return -EFAULT;
+
+	ret = virtwl_import_txnv(READ, &ioctl_recvv, fast_iov, &iov, &to);
+	if (ret)
+		return ret;
+
+	ret = virtwl_recv_txn(filp, &to, user_txnv->fds, VIRTWL_SEND_MAX_ALLOCS,
+			      NULL, &user_txnv->len);
+	kfree(iov);
+
+	return ret;
+}
+
+static long virtwl_ioctl_recvx(struct file *filp, void __user *ptr)
+{
+	struct virtwl_ioctl_txnx __user *user_txnx = ptr;
+	struct virtwl_ioctl_txnx ioctl_recvx;
+	struct iovec iov;
+	struct iov_iter to;
+	int ret;
+
+	if (copy_from_user(&ioctl_recvx, ptr, sizeof(ioctl_recvx)))
+		return -EFAULT;
+
+	ret = import_single_range(READ, u64_to_user_ptr(ioctl_recvx.data),
+				  ioctl_recvx.len, &iov, &to);
+	if (ret)
+		return ret;
+
+	return virtwl_recv_txn(filp, &to, u64_to_user_ptr(ioctl_recvx.fds),
+			       min_t(size_t, ioctl_recvx.fd_count,
+				     VIRTWL_SEND_MAX_ALLOCS),
+			       &user_txnx->fd_count, &user_txnx->len);
+}
+
+static long virtwl_ioctl_ring_setup(struct file *filp, void __user *ptr)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	struct virtwl_ioctl_ring_setup setup;
+	struct virtwl_ring *ring;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&setup, ptr, sizeof(setup)))
+		return -EFAULT;
+
+	if (!(vfd->flags & VIRTIO_WL_VFD_CONTROL) || setup.flags ||
+	    !is_power_of_2(setup.slot_count) ||
+	    setup.slot_count > VIRTWL_RING_MAX_SLOTS)
+		return -EINVAL;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+
+	ring->slot_count = setup.slot_count;
+	ring->nr_pages = 1 + 2 * setup.slot_count;
+	mutex_init(&ring->kick_lock);
+	spin_lock_init(&ring->sq_lock);
+
+	ring->pages = kcalloc(ring->nr_pages, sizeof(*ring->pages),
+			      GFP_KERNEL);
+	ring->sq_done = kcalloc(BITS_TO_LONGS(ring->slot_count),
+				sizeof(*ring->sq_done), GFP_KERNEL);
+	if (!ring->pages || !ring->sq_done) {
+		ret = -ENOMEM;
+		goto free_ring;
+	}
+
+	for (i = 0; i < ring->nr_pages; i++) {
+		ring->pages[i] = (void *)get_zeroed_page(GFP_KERNEL);
+		if (!ring->pages[i]) {
+			ret = -ENOMEM;
+			goto free_ring;
+		}
+	}
+
+	ring->hdr = ring->pages[0];
+	ring->hdr->slot_count = ring->slot_count;
+	ring->hdr->slot_size = PAGE_SIZE;
+	ring->hdr->sq_offset = PAGE_SIZE;
+	ring->hdr->cq_offset = (1 + ring->slot_count) * PAGE_SIZE;
+
+	mutex_lock(&vfd->lock);
+	ret = vfd->ring ? -EBUSY : 0;
+	if (!ret)
+		smp_store_release(&vfd->ring, ring);
+	mutex_unlock(&vfd->lock);
+	if (!ret)
+		return 0;
+
+free_ring:
+	virtwl_ring_free(ring);
+	return ret;
+}
+
+/* Called from vq_out_work_handler once the host is done with an sq slot. */
+static void vfd_ring_send_finish(struct virtwl_out_req *req)
+{
+	struct virtwl_ring_send *send = container_of(req,
+						     struct virtwl_ring_send,
+						     req);
+	struct virtwl_vfd *vfd = send->vfd;
+	struct virtwl_ring *ring = vfd->ring;
+	u32 mask = ring->slot_count - 1;
+	int ret = virtwl_resp_err(send->ctrl_send.hdr.type);
+
+	if (ret)
+		cmpxchg(&ring->hdr->sq_err, 0, ret);
+
+	/* slots go back in order even if the host finishes them out of order */
+	spin_lock(&ring->sq_lock);
+	set_bit(send->slot & mask, ring->sq_done);
+	while (test_and_clear_bit(ring->sq_head & mask, ring->sq_done))
+		ring->sq_head++;
+	smp_store_release(&ring->hdr->sq_head, ring->sq_head);
+	spin_unlock(&ring->sq_lock);
+	/* pollers may be waiting for sq slots */
+	wake_up_interruptible_poll(&vfd->out_waitq, POLLOUT);
+
+	virtwl_cmd_free(vfd->vi, send, sizeof(*send));
+	/* this must be the last access to vfd, which may be closed after */
+	atomic_dec(&vfd->sends_in_flight);
+}
+
+/*
+ * Sends the sq slots the user added since the last kick, pointing the host
+ * straight at them, with one kick of the out vq. Like
+ * VIRTWL_IOCTL_SEND_BATCH, this returns the number of slots sent, or an
+ * error if none were.
+ */
+static long virtwl_ioctl_ring_kick(struct file *filp)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	struct virtwl_ring *ring = smp_load_acquire(&vfd->ring);
+	struct virtwl_vq_pair *qp = vfd->qp;
+	struct mutex *vq_lock = &qp->vq_locks[VIRTWL_VQ_OUT];
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	struct virtwl_ring_send *send;
+	struct virtwl_ring_slot *slot;
+	unsigned int out_sgs;
+	long sent = 0;
+	u32 tail;
+	u32 len;
+	int ret = 0;
+
+	if (!ring)
+		return -EINVAL;
+
+	mutex_lock(&ring->kick_lock);
+
+	/* slots the host isn't done with yet must not be reused */
+	tail = smp_load_acquire(&ring->hdr->sq_tail);
+	if (tail - ring->sq_next > ring->slot_count ||
+	    tail - READ_ONCE(ring->sq_head) > ring->slot_count) {
+		ret = -EINVAL;
+		goto out_unlock;
+	}
+
+	mutex_lock(vq_lock);
+	for (; ring->sq_next != tail; ring->sq_next++) {
+		slot = virtwl_ring_sq_slot(ring, ring->sq_next);
+		len = READ_ONCE(slot->len);
+		if (len > VIRTWL_RING_SLOT_DATA_MAX) {
+			ret = -EMSGSIZE;
+			break;
+		}
+
+		send = virtwl_cmd_alloc(vfd->vi, sizeof(*send));
+		if (!send) {
+			ret = -ENOMEM;
+			break;
+		}
+		send->vfd = vfd;
+		send->slot = ring->sq_next;
+		send->ctrl_send.hdr.type = VIRTIO_WL_CMD_VFD_SEND;
+		send->ctrl_send.vfd_id = vfd->id;
+
+		sg_init_one(&send->out_sg, &send->ctrl_send,
+			    sizeof(send->ctrl_send));
+		sg_init_one(&send->data_sg, slot->data, len);
+		sg_init_one(&send->in_sg, &send->ctrl_send.hdr,
+			    sizeof(struct virtio_wl_ctrl_hdr));
+		out_sgs = 0;
+		send->sgs[out_sgs++] = &send->out_sg;
+		if (len)
+			send->sgs[out_sgs++] = &send->data_sg;
+		send->sgs[out_sgs] = &send->in_sg;
+
+		virtwl_out_req_init(&send->req, vfd_ring_send_finish);
+		atomic_inc(&vfd->sends_in_flight);
+		ret = vq_add_out_locked(qp, send->sgs, out_sgs, 1, &send->req,
+					nonblock);
+		if (ret) {
+			atomic_dec(&vfd->sends_in_flight);
+			virtwl_cmd_free(vfd->vi, send, sizeof(*send));
+			break;
+		}
+		virtwl_stat_send(vfd, len, 0);
+		sent++;
+	}
+	if (sent)
+		vq_kick(qp, VIRTWL_VQ_OUT);
+	mutex_unlock(vq_lock);
+
+out_unlock:
+	mutex_unlock(&ring->kick_lock);
+	return sent ? sent : ret;
+}
+
+static long virtwl_ioctl_dmabuf_export(struct file *filp, void __user *ptr)
+{
+	struct virtwl_vfd *vfd = filp->private_data;
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct virtwl_ioctl_dmabuf ioctl_dmabuf;
+	struct dma_buf *dmabuf;
+	int ret;
+
+	if (copy_from_user(&ioctl_dmabuf, ptr, sizeof(ioctl_dmabuf)))
+		return -EFAULT;
+
+	if (ioctl_dmabuf.flags || !(vfd->flags & VIRTIO_WL_VFD_MAP) ||
+	    (vfd->flags & VIRTIO_WL_VFD_CONTROL))
+		return -EINVAL;
+
+	exp_info.ops = &virtwl_dmabuf_ops;
+	exp_info.size = PAGE_ALIGN(vfd->size);
+	exp_info.flags = vfd->flags & VIRTIO_WL_VFD_WRITE ? O_RDWR : O_RDONLY;
+	/* the host must not free the memory while the dma-buf is around */
+	exp_info.priv = get_file(filp);
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		fput(filp);
+		return PTR_ERR(dmabuf);
+	}
+
+	ret = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (ret < 0) {
+		dma_buf_put(dmabuf);
+		return ret;
+	}
+
+	ioctl_dmabuf.fd = ret;
+	if (copy_to_user(ptr, &ioctl_dmabuf, sizeof(ioctl_dmabuf))) {
+		/* The release operation will drop the file of the vfd */
+		sys_close(ioctl_dmabuf.fd);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
 static long virtwl_vfd_ioctl(struct file *filp, unsigned int cmd,
 			     void __user *ptr)
 {
@@ -1005,6 +3944,20 @@ static long virtwl_vfd_ioctl(struct file *filp, unsigned int cmd,
 		return virtwl_ioctl_send(filp, ptr);
 	case VIRTWL_IOCTL_RECV:
 		return virtwl_ioctl_recv(filp, ptr);
+	case VIRTWL_IOCTL_SENDV:
+		return virtwl_ioctl_sendv(filp, ptr);
+	case VIRTWL_IOCTL_RECVV:
+		return virtwl_ioctl_recvv(filp, ptr);
+	case VIRTWL_IOCTL_SENDX:
+		return virtwl_ioctl_sendx(filp, ptr);
+	case VIRTWL_IOCTL_RECVX:
+		return virtwl_ioctl_recvx(filp, ptr);
+	case VIRTWL_IOCTL_RING_SETUP:
+		return virtwl_ioctl_ring_setup(filp, ptr);
+	case VIRTWL_IOCTL_RING_KICK:
+		return virtwl_ioctl_ring_kick(filp);
+	case VIRTWL_IOCTL_DMABUF_EXPORT:
+		return virtwl_ioctl_dmabuf_export(filp, ptr);
 	default:
 		return -ENOTTY;
 	}
@@ -1028,7 +3981,7 @@ static long virtwl_ioctl_new(struct file *filp, void __user *ptr)
 
 	ioctl_new.size = PAGE_ALIGN(ioctl_new.size);
 
-	vfd = do_new(vi, ioctl_new.type, ioctl_new.size,
+	vfd = do_new(vi, ioctl_new.type, ioctl_new.flags, ioctl_new.size,
 		     filp->f_flags & O_NONBLOCK);
 	if (IS_ERR(vfd))
 		return PTR_ERR(vfd);
@@ -1051,6 +4004,299 @@ static long virtwl_ioctl_new(struct file *filp, void __user *ptr)
 	return 0;
 }
 
+/*
+ * Creates every allocation or none. Commands for the allocations not served
+ * from the cache go out with a single kick.
+ */
+static long virtwl_ioctl_new_multi(struct file *filp, void __user *ptr)
+{
+	struct virtwl_info *vi = filp->private_data;
+	struct virtwl_vq_pair *qp = &vi->qps[0];
+	bool nonblock = filp->f_flags & O_NONBLOCK;
+	struct virtwl_ioctl_new_multi ioctl_new;
+	struct virtwl_new *news[VIRTWL_NEW_MULTI_MAX] = { 0 };
+	struct virtwl_vfd *vfds[VIRTWL_NEW_MULTI_MAX] = { 0 };
+	DECLARE_BITMAP(cached, VIRTWL_NEW_MULTI_MAX) = { 0 };
+	u32 i;
+	int ret;
+	int err;
+
+	if (copy_from_user(&ioctl_new, ptr, sizeof(ioctl_new)))
+		return -EFAULT;
+
+	if (!ioctl_new.count || ioctl_new.count > VIRTWL_NEW_MULTI_MAX)
+		return -EINVAL;
+
+	ret = virtwl_new_check(VIRTWL_IOCTL_NEW_ALLOC, ioctl_new.flags);
+	if (ret)
+		return ret;
+
+	ioctl_new.size = PAGE_ALIGN(ioctl_new.size);
+
+	for (i = 0; i < ioctl_new.count; i++) {
+		vfds[i] = virtwl_alloc_cache_get(vi, ioctl_new.size,
+						 ioctl_new.flags);
+		if (vfds[i]) {
+			__set_bit(i, cached);
+			continue;
+		}
+
+		news[i] = virtwl_new_prepare(vi, VIRTWL_IOCTL_NEW_ALLOC,
+					     ioctl_new.flags, ioctl_new.size);
+		if (IS_ERR(news[i])) {
+			ret = PTR_ERR(news[i]);
+			news[i] = NULL;
+			break;
+		}
+	}
+
+	/* allocations all live on the first qp */
+	mutex_lock(&qp->vq_locks[VIRTWL_VQ_OUT]);
+	for (i = 0; i < ioctl_new.count; i++) {
+		if (!news[i])
+			continue;
+		err = ret ? ret : vq_add_out_locked(qp, news[i]->sgs, 1, 1,
+						    &news[i]->req, nonblock);
+		if (err) {
+			ret = err;
+			/* finish removes the vfds of commands never queued */
+			vfds[i] = virtwl_new_finish(news[i], err);
+			news[i] = NULL;
+		}
+	}
+	vq_kick(qp, VIRTWL_VQ_OUT);
+	mutex_unlock(&qp->vq_locks[VIRTWL_VQ_OUT]);
+
+	for (i = 0; i < ioctl_new.count; i++) {
+		if (news[i])
+			vfds[i] = virtwl_new_finish(news[i], 0);
+		if (IS_ERR(vfds[i])) {
+			if (!ret)
+				ret = PTR_ERR(vfds[i]);
+			vfds[i] = NULL;
+		}
+	}
+	if (ret)
+		goto close_vfds;
+
+	for (i = 0; i < ioctl_new.count; i++) {
+		ret = anon_inode_getfd("[virtwl_vfd]", &virtwl_vfd_fops,
+				       vfds[i], O_CLOEXEC | O_RDWR);
+		if (ret < 0)
+			goto close_fds;
+		ioctl_new.fds[i] = ret;
+	}
+
+	if (copy_to_user(ptr, &ioctl_new, sizeof(ioctl_new))) {
+		ret = -EFAULT;
+		goto close_fds;
+	}
+
+	return 0;
+
+close_fds:
+	/* The release operation will handle freeing these allocs */
+	while (i--) {
+		sys_close(ioctl_new.fds[i]);
+		vfds[i] = NULL;
+	}
+close_vfds:
+	for (i = 0; i < ioctl_new.count; i++) {
+		if (!vfds[i])
+			continue;
+		/* the ones from the cache were never handed out, so keep them */
+		if (!test_bit(i, cached) || !virtwl_alloc_cache_put(vfds[i]))
+			do_vfd_close(vfds[i]);
+	}
+	return ret;
+}
+
+/*
+ * Hands the host the pages of the dma-buf as the device sees them, merging
+ * contiguous runs, and returns the unlocked vfd the host made of them.
+ */
+static struct virtwl_vfd *do_dmabuf_import(struct virtwl_info *vi, int fd)
+{
+	struct virtio_wl_ctrl_vfd_import *ctrl_import;
+	struct virtio_wl_vfd_extent *extents;
+	struct dma_buf_attachment *attach;
+	struct virtwl_out_req req;
+	struct scatterlist out_sg;
+	struct scatterlist in_sg;
+	struct scatterlist *sgs[] = { &out_sg, &in_sg };
+	struct scatterlist *sg;
+	struct dma_buf *dmabuf;
+	struct sg_table *sgt;
+	struct virtwl_vfd *vfd;
+	u64 last_pfn = 0;
+	u32 last_count = 0;
+	u32 count = 0;
+	unsigned int i;
+	int ret;
+
+	if (!virtio_has_feature(vi->vdev, VIRTIO_WL_F_IMPORT))
+		return ERR_PTR(-EOPNOTSUPP);
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return ERR_CAST(dmabuf);
+
+	/* the host knows vfd sizes as 32 bits */
+	if (dmabuf->size > U32_MAX) {
+		ret = -EINVAL;
+		goto put_dmabuf;
+	}
+
+	/* the virtio device itself does no DMA, its transport does */
+	attach = dma_buf_attach(dmabuf, vi->vdev->dev.parent);
+	if (IS_ERR(attach)) {
+		ret = PTR_ERR(attach);
+		goto put_dmabuf;
+	}
+
+	sgt = dma_buf_map_attachment(attach, DMA_BIDIRECTIONAL);
+	if (IS_ERR(sgt)) {
+		ret = PTR_ERR(sgt);
+		goto detach;
+	}
+
+	ctrl_import = virtwl_cmd_alloc(vi, VIRTWL_OUT_BUFFER_SIZE);
+	if (!ctrl_import) {
+		ret = -ENOMEM;
+		goto unmap;
+	}
+	extents = (struct virtio_wl_vfd_extent *)(ctrl_import + 1);
+
+	for_each_sg(sgt->sgl, sg, sgt->nents, i) {
+		dma_addr_t addr = sg_dma_address(sg);
+		unsigned int len = sg_dma_len(sg);
+		u64 pfn = addr >> PAGE_SHIFT;
+		u32 page_count = len >> PAGE_SHIFT;
+
+		if (!PAGE_ALIGNED(addr) || !PAGE_ALIGNED(len)) {
+			ret = -EINVAL;
+			goto free_ctrl;
+		}
+
+		if (count && last_pfn + last_count == pfn) {
+			last_count += page_count;
+			extents[count - 1].page_count = cpu_to_le32(last_count);
+			continue;
+		}
+
+		if (count == VIRTWL_IMPORT_EXTENTS_MAX) {
+			ret = -E2BIG;
+			goto free_ctrl;
+		}
+		extents[count].pfn = cpu_to_le64(pfn);
+		extents[count].page_count = cpu_to_le32(page_count);
+		extents[count].padding = 0;
+		last_pfn = pfn;
+		last_count = page_count;
+		count++;
+	}
+
+	vfd = virtwl_vfd_alloc(vi);
+	if (!vfd) {
+		ret = -ENOMEM;
+		goto free_ctrl;
+	}
+
+	/* only reserve the id until the host has the import, as for a new */
+	mutex_lock(&vi->vfds_lock);
+	ret = idr_alloc(&vi->vfds, NULL, 1, vi->max_vfd_id, GFP_KERNEL);
+	mutex_unlock(&vi->vfds_lock);
+	if (ret <= 0) {
+		virtwl_vfd_put(vfd);
+		goto free_ctrl;
+	}
+
+	vfd->id = ret;
+	vfd->size = dmabuf->size;
+	if (dmabuf->file->f_mode & FMODE_WRITE)
+		vfd->flags = VIRTIO_WL_VFD_WRITE;
+
+	ctrl_import->hdr.type = VIRTIO_WL_CMD_VFD_IMPORT;
+	ctrl_import->hdr.flags = 0;
+	ctrl_import->vfd_id = cpu_to_le32(vfd->id);
+	ctrl_import->flags = cpu_to_le32(vfd->flags);
+	ctrl_import->size = cpu_to_le32(vfd->size);
+	ctrl_import->extent_count = cpu_to_le32(count);
+
+	sg_init_one(&out_sg, ctrl_import,
+		    sizeof(*ctrl_import) + count * sizeof(*extents));
+	sg_init_one(&in_sg, &ctrl_import->hdr, sizeof(ctrl_import->hdr));
+
+	virtwl_out_req_init(&req, NULL);
+	ret = vq_queue_out(vfd->qp, sgs, 1, 1, &req, false /* block */);
+	if (!ret) {
+		wait_for_completion(&req.finish_completion);
+		ret = virtwl_resp_err(ctrl_import->hdr.type);
+	}
+	virtwl_cmd_free(vi, ctrl_import, VIRTWL_OUT_BUFFER_SIZE);
+	if (ret) {
+		mutex_lock(&vi->vfds_lock);
+		idr_remove(&vi->vfds, vfd->id);
+		mutex_unlock(&vi->vfds_lock);
+		virtwl_vfd_remove(vfd);
+		goto unmap;
+	}
+
+	/* virtwl_vfd_remove() releases these once the host closed the vfd */
+	vfd->import_attach = attach;
+	vfd->import_sgt = sgt;
+
+	mutex_lock(&vi->vfds_lock);
+	idr_replace(&vi->vfds, vfd, vfd->id);
+	mutex_unlock(&vi->vfds_lock);
+
+	return vfd;
+
+free_ctrl:
+	virtwl_cmd_free(vi, ctrl_import, VIRTWL_OUT_BUFFER_SIZE);
+unmap:
+	dma_buf_unmap_attachment(attach, sgt, DMA_BIDIRECTIONAL);
+detach:
+	dma_buf_detach(dmabuf, attach);
+put_dmabuf:
+	dma_buf_put(dmabuf);
+	return ERR_PTR(ret);
+}
+
+static long virtwl_ioctl_dmabuf_import(struct file *filp, void __user *ptr)
+{
+	struct virtwl_info *vi = filp->private_data;
+	struct virtwl_ioctl_dmabuf ioctl_dmabuf;
+	struct virtwl_vfd *vfd;
+	int ret;
+
+	if (copy_from_user(&ioctl_dmabuf, ptr, sizeof(ioctl_dmabuf)))
+		return -EFAULT;
+
+	if (ioctl_dmabuf.flags)
+		return -EINVAL;
+
+	vfd = do_dmabuf_import(vi, ioctl_dmabuf.fd);
+	if (IS_ERR(vfd))
+		return PTR_ERR(vfd);
+
+	ret = anon_inode_getfd("[virtwl_vfd]", &virtwl_vfd_fops, vfd,
+			       O_CLOEXEC | O_RDWR);
+	if (ret < 0) {
+		do_vfd_close(vfd);
+		return ret;
+	}
+
+	ioctl_dmabuf.fd = ret;
+	if (copy_to_user(ptr, &ioctl_dmabuf, sizeof(ioctl_dmabuf))) {
+		/* The release operation will handle closing this vfd */
+		sys_close(ioctl_dmabuf.fd);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
 static long virtwl_ioctl_ptr(struct file *filp, unsigned int cmd,
 			     void __user *ptr)
 {
@@ -1060,6 +4306,12 @@ static long virtwl_ioctl_ptr(struct file *filp, unsigned int cmd,
 	switch (cmd) {
 	case VIRTWL_IOCTL_NEW:
 		return virtwl_ioctl_new(filp, ptr);
+	case VIRTWL_IOCTL_SEND_BATCH:
+		return virtwl_ioctl_send_batch(filp, ptr);
+	case VIRTWL_IOCTL_NEW_MULTI:
+		return virtwl_ioctl_new_multi(filp, ptr);
+	case VIRTWL_IOCTL_DMABUF_IMPORT:
+		return virtwl_ioctl_dmabuf_import(filp, ptr);
 	default:
 		return -ENOTTY;
 	}
@@ -1097,18 +4349,111 @@ static struct file_operations virtwl_vfd_fops =
 {
 	.mmap = virtwl_vfd_mmap,
 	.poll = virtwl_vfd_poll,
+	.read_iter = virtwl_vfd_read_iter,
+	.write_iter = virtwl_vfd_write_iter,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
+	.llseek = no_llseek,
 	.unlocked_ioctl = virtwl_ioctl,
 	.compat_ioctl = virtwl_ioctl_compat,
 	.release = virtwl_vfd_release,
 };
 
+/*
+ * Finds the in and out virtqueue of each of the vi->qp_count queue pairs, at
+ * probe and again on restore.
+ */
+static int virtwl_find_vqs(struct virtio_device *vdev, struct virtwl_info *vi)
+{
+	unsigned int nvqs = vi->qp_count * VIRTWL_QUEUE_COUNT;
+	struct virtqueue **vqs;
+	vq_callback_t **vq_callbacks;
+	const char **vq_names;
+	unsigned int i;
+	int ret = -ENOMEM;
+
+	vqs = kcalloc(nvqs, sizeof(*vqs), GFP_KERNEL);
+	vq_callbacks = kcalloc(nvqs, sizeof(*vq_callbacks), GFP_KERNEL);
+	vq_names = kcalloc(nvqs, sizeof(*vq_names), GFP_KERNEL);
+	if (!vqs || !vq_callbacks || !vq_names)
+		goto free_arrays;
+
+	for (i = 0; i < vi->qp_count; i++) {
+		struct virtwl_vq_pair *qp = &vi->qps[i];
+		unsigned int in = i * VIRTWL_QUEUE_COUNT + VIRTWL_VQ_IN;
+		unsigned int out = i * VIRTWL_QUEUE_COUNT + VIRTWL_VQ_OUT;
+
+		vq_callbacks[in] = vq_in_cb;
+		vq_callbacks[out] = vq_out_cb;
+		vq_names[in] = qp->vq_names[VIRTWL_VQ_IN];
+		vq_names[out] = qp->vq_names[VIRTWL_VQ_OUT];
+	}
+
+	ret = vdev->config->find_vqs(vdev, nvqs, vqs, vq_callbacks, vq_names);
+	if (ret)
+		goto free_arrays;
+
+	for (i = 0; i < nvqs; i++)
+		vi->qps[i / VIRTWL_QUEUE_COUNT].vqs[i % VIRTWL_QUEUE_COUNT] =
+			vqs[i];
+	for (i = 0; i < vi->qp_count; i++)
+		vi->qps[i].out_free = vi->qps[i].vqs[VIRTWL_VQ_OUT]->num_free;
+
+free_arrays:
+	kfree(vq_names);
+	kfree(vq_callbacks);
+	kfree(vqs);
+	return ret;
+}
+
+/* Sets up vi->qp_count queue pairs and finds their virtqueues. */
+static int virtwl_find_vq_pairs(struct virtio_device *vdev,
+				struct virtwl_info *vi)
+{
+	unsigned int i;
+	int ret;
+
+	vi->qps = kcalloc(vi->qp_count, sizeof(*vi->qps), GFP_KERNEL);
+	if (!vi->qps)
+		return -ENOMEM;
+
+	for (i = 0; i < vi->qp_count; i++) {
+		struct virtwl_vq_pair *qp = &vi->qps[i];
+
+		qp->vi = vi;
+		mutex_init(&qp->vq_locks[VIRTWL_VQ_IN]);
+		mutex_init(&qp->vq_locks[VIRTWL_VQ_OUT]);
+		INIT_WORK(&qp->in_vq_work, vq_in_work_handler);
+		INIT_WORK(&qp->out_vq_work, vq_out_work_handler);
+		init_waitqueue_head(&qp->out_waitq);
+		spin_lock_init(&qp->out_blocked_lock);
+		INIT_LIST_HEAD(&qp->out_blocked);
+		INIT_HLIST_HEAD(&qp->host_vfd_pool);
+		hash_init(qp->offers);
+		spin_lock_init(&qp->host_vfds_lock);
+		INIT_LIST_HEAD(&qp->host_vfds);
+
+		snprintf(qp->vq_names[VIRTWL_VQ_IN],
+			 sizeof(qp->vq_names[VIRTWL_VQ_IN]), "in%u", i);
+		snprintf(qp->vq_names[VIRTWL_VQ_OUT],
+			 sizeof(qp->vq_names[VIRTWL_VQ_OUT]), "out%u", i);
+	}
+
+	ret = virtwl_find_vqs(vdev, vi);
+	if (ret) {
+		kfree(vi->qps);
+		vi->qps = NULL;
+	}
+	return ret;
+}
+
 static int probe_common(struct virtio_device *vdev)
 {
-	int i;
+	unsigned int i;
 	int ret;
 	struct virtwl_info *vi = NULL;
-	vq_callback_t *vq_callbacks[] = { vq_in_cb, vq_out_cb };
-	const char *vq_names[] = { "in", "out" };
+	struct virtqueue *vq;
+	void *buffer;
 
 	vi = kzalloc(sizeof(struct virtwl_info), GFP_KERNEL);
 	if (!vi) {
@@ -1117,6 +4462,18 @@ static int probe_common(struct virtio_device *vdev)
 	}
 
 	vdev->priv = vi;
+	vi->vdev = vdev;
+
+	vi->stats = alloc_percpu(struct virtwl_stats);
+	if (!vi->stats) {
+		kfree(vi);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&vi->cmd_pool_lock);
+	INIT_LIST_HEAD(&vi->cmd_pool);
+	/* best effort, commands fall back to kmalloc if the pool runs dry */
+	virtwl_cmd_pool_fill(vi);
 
 	ret = alloc_chrdev_region(&vi->dev_num, 0, 1, "wl");
 	if (ret) {
@@ -1134,7 +4491,8 @@ static int probe_common(struct virtio_device *vdev)
 
 	}
 
-	vi->dev = device_create(vi->class, NULL, vi->dev_num, vi, "wl%d", 0);
+	vi->dev = device_create_with_groups(vi->class, NULL, vi->dev_num, vi,
+					    virtwl_groups, "wl%d", 0);
 	if (IS_ERR(vi->dev)) {
 		ret = PTR_ERR(vi->dev);
 		printk("virtwl: failed to create wl0 device: %d\n", ret);
@@ -1149,37 +4507,98 @@ static int probe_common(struct virtio_device *vdev)
 		goto destroy_device;
 	}
 
-	for (i = 0; i < VIRTWL_QUEUE_COUNT; i++)
-		mutex_init(&vi->vq_locks[i]);
+	vi->qp_count = 1;
+	if (virtio_has_feature(vdev, VIRTIO_WL_F_MQ)) {
+		unsigned int limit = max_queue_pairs ? : num_online_cpus();
+
+		vi->qp_count = virtio_cread16(vdev,
+			offsetof(struct virtio_wl_config, max_queue_pairs));
+		vi->qp_count = clamp_t(unsigned int, vi->qp_count, 1,
+				       min_t(unsigned int, limit,
+					     VIRTWL_MAX_QUEUE_PAIRS));
+	}
+
+	vi->max_vfd_id = VIRTWL_MAX_ALLOC;
+	if (virtio_has_feature(vdev, VIRTIO_WL_F_MAX_VFD_ID)) {
+		vi->max_vfd_id = virtio_cread32(vdev,
+			offsetof(struct virtio_wl_config, max_vfd_id));
+		vi->max_vfd_id = clamp_t(u32, vi->max_vfd_id, VIRTWL_MAX_ALLOC,
+					 VFD_HOST_VFD_ID_BIT);
+	}
+
+	/* input latency must not depend on unrelated work on system_wq */
+	vi->wq = alloc_workqueue("virtwl", WQ_HIGHPRI | WQ_MEM_RECLAIM |
+				 (workqueue_unbound ? WQ_UNBOUND : 0), 0);
+	if (!vi->wq) {
+		ret = -ENOMEM;
+		printk("virtwl: failed to allocate workqueue\n");
+		goto del_cdev;
+	}
 
-	ret = vdev->config->find_vqs(vdev, VIRTWL_QUEUE_COUNT, vi->vqs,
-				     vq_callbacks, vq_names);
+	ret = virtwl_find_vq_pairs(vdev, vi);
 	if (ret) {
 		printk("virtwl: failed to find virtio wayland queues: %d\n",
 		       ret);
-		goto del_cdev;
+		goto destroy_wq;
 	}
 
-	INIT_WORK(&vi->in_vq_work, vq_in_work_handler);
-	INIT_WORK(&vi->out_vq_work, vq_out_work_handler);
-	init_waitqueue_head(&vi->out_waitq);
-
 	mutex_init(&vi->vfds_lock);
 	idr_init(&vi->vfds);
 
+	mutex_init(&vi->alloc_cache_lock);
+	hash_init(vi->alloc_cache);
+	INIT_LIST_HEAD(&vi->alloc_cache_lru);
+	vi->alloc_cache_shrinker.count_objects = virtwl_alloc_cache_count;
+	vi->alloc_cache_shrinker.scan_objects = virtwl_alloc_cache_scan;
+	vi->alloc_cache_shrinker.seeks = DEFAULT_SEEKS;
+
+	spin_lock_init(&vi->close_lock);
+	INIT_LIST_HEAD(&vi->close_pending);
+	INIT_DELAYED_WORK(&vi->close_work, virtwl_close_work_handler);
+	atomic_set(&vi->closes_in_flight, 0);
+	init_waitqueue_head(&vi->close_waitq);
+
+	vi->in_buf_size = clamp_t(size_t, in_buffer_size, VIRTWL_IN_BUFFER_SIZE,
+				  VIRTWL_IN_BUFFER_SIZE_MAX);
+	vi->in_buf_count = in_buffer_count ? in_buffer_count :
+			   VIRTWL_IN_BUFFER_BYTES_DEFAULT / vi->in_buf_size;
+
 	/* lock is unneeded as we have unique ownership */
-	ret = vq_fill_locked(vi->vqs[VIRTWL_VQ_IN]);
+	for (i = 0; i < vi->qp_count; i++) {
+		ret = vq_fill_locked(&vi->qps[i]);
+		if (ret) {
+			printk("virtwl: failed to fill in virtqueue: %d", ret);
+			goto clear_in_vqs;
+		}
+	}
+
+	/* i == vi->qp_count, so clear_in_vqs clears every in vq */
+	ret = register_shrinker(&vi->alloc_cache_shrinker);
 	if (ret) {
-		printk("virtwl: failed to fill in virtqueue: %d", ret);
-		goto del_cdev;
+		printk("virtwl: failed to register shrinker: %d\n", ret);
+		goto clear_in_vqs;
 	}
 
+	virtwl_debugfs_init(vi);
+
 	virtio_device_ready(vdev);
-	virtqueue_kick(vi->vqs[VIRTWL_VQ_IN]);
+	for (i = 0; i < vi->qp_count; i++)
+		vq_kick(&vi->qps[i], VIRTWL_VQ_IN);
 
 
 	return 0;
 
+clear_in_vqs:
+	/* the queue that failed has already been cleared */
+	while (i--) {
+		vq = vi->qps[i].vqs[VIRTWL_VQ_IN];
+		while ((buffer = virtqueue_detach_unused_buf(vq)))
+			kfree(buffer);
+	}
+	vdev->config->del_vqs(vdev);
+	kfree(vi->qps);
+destroy_wq:
+	destroy_workqueue(vi->wq);
 del_cdev:
 	cdev_del(&vi->cdev);
 destroy_device:
@@ -1187,20 +4606,56 @@ destroy_device:
 destroy_class:
 	class_destroy(vi->class);
 unregister_region:
-	unregister_chrdev_region(vi->dev_num, 0);
+	unregister_chrdev_region(vi->dev_num, 1);
 free_vi:
+	virtwl_cmd_pool_drain(vi);
+	free_percpu(vi->stats);
 	kfree(vi);
 	return ret;
 }
 
+/* Frees the in buffers that are neither with the host nor held by a vfd. */
+static void vq_in_free_unused(struct virtwl_vq_pair *qp)
+{
+	void *buffer;
+
+	while ((buffer = qp->in_saved)) {
+		qp->in_saved = *(void **)buffer;
+		kfree(buffer);
+	}
+	if (qp->frozen)
+		return;
+	while ((buffer = virtqueue_detach_unused_buf(qp->vqs[VIRTWL_VQ_IN])))
+		kfree(buffer);
+}
+
 static void remove_common(struct virtio_device *vdev)
 {
 	struct virtwl_info *vi = vdev->priv;
+	unsigned int i;
 
+	debugfs_remove_recursive(vi->debugfs);
+	virtwl_alloc_cache_drain(vi);
+	virtwl_close_flush(vi);
 	cdev_del(&vi->cdev);
 	put_device(vi->dev);
 	class_destroy(vi->class);
-	unregister_chrdev_region(vi->dev_num, 0);
+	unregister_chrdev_region(vi->dev_num, 1);
+
+	/* no more callbacks, then no more work that could touch the vqs */
+	vdev->config->reset(vdev);
+	virtwl_close_drain(vi);
+	destroy_workqueue(vi->wq);
+	for (i = 0; i < vi->qp_count; i++) {
+		vq_host_vfd_drain(&vi->qps[i]);
+		vq_in_free_unused(&vi->qps[i]);
+	}
+	if (!vi->qps[0].frozen)
+		vdev->config->del_vqs(vdev);
+
+	virtwl_cmd_pool_drain(vi);
+	kfree(vi->qps);
+	free_percpu(vi->stats);
 	kfree(vi);
 }
 
@@ -1218,19 +4673,267 @@ static void virtwl_scan(struct virtio_device *vdev)
 {
 }
 
+#ifdef CONFIG_PM_SLEEP
+static void virtwl_restore_prepare(struct virtwl_restore *restore,
+				   struct virtwl_vfd *vfd)
+{
+	struct virtio_wl_ctrl_vfd_restore *ctrl = &restore->ctrl;
+
+	ctrl->hdr.type = VIRTIO_WL_CMD_VFD_RESTORE;
+	if (vfd) {
+		kref_get(&vfd->refcount);
+		ctrl->vfd_id = vfd->id;
+		ctrl->flags = vfd->flags;
+		ctrl->pfn = vfd->pfn;
+		ctrl->size = vfd->size;
+	}
+	restore->vfd = vfd;
+
+	virtwl_out_req_init(&restore->req, NULL);
+	sg_init_one(&restore->out_sg, ctrl, sizeof(*ctrl));
+	sg_init_one(&restore->in_sg, &ctrl->hdr, sizeof(ctrl->hdr));
+	restore->sgs[0] = &restore->out_sg;
+	restore->sgs[1] = &restore->in_sg;
+}
+
+/*
+ * Names every vfd still open to a host with VIRTIO_WL_F_RESTORE. All of them
+ * are queued on their own qp before waiting for any, then the end of the list
+ * lets the host close what the guest no longer has.
+ */
+static void virtwl_reannounce(struct virtwl_info *vi)
+{
+	struct virtwl_restore *restores, *restore;
+	unsigned int count = 0, n = 0, i, j;
+	bool added;
+	struct virtwl_vfd *vfd;
+	int id;
+
+	mutex_lock(&vi->vfds_lock);
+	idr_for_each_entry(&vi->vfds, vfd, id)
+		count++;
+	for (i = 0; i < vi->qp_count; i++) {
+		spin_lock(&vi->qps[i].host_vfds_lock);
+		list_for_each_entry(vfd, &vi->qps[i].host_vfds, host_node)
+			count++;
+		spin_unlock(&vi->qps[i].host_vfds_lock);
+	}
+
+	if (!virtio_has_feature(vi->vdev, VIRTIO_WL_F_RESTORE)) {
+		mutex_unlock(&vi->vfds_lock);
+		if (count)
+			printk("virtwl: %u vfds were lost to the device reset\n",
+			       count);
+		return;
+	}
+
+	/* vfds the host offers from here on are new to it, and not named */
+	restores = kcalloc(count + 1, sizeof(*restores), GFP_KERNEL);
+	if (!restores) {
+		mutex_unlock(&vi->vfds_lock);
+		printk("virtwl: failed to allocate vfd restores\n");
+		return;
+	}
+	idr_for_each_entry(&vi->vfds, vfd, id)
+		virtwl_restore_prepare(&restores[n++], vfd);
+	for (i = 0; i < vi->qp_count; i++) {
+		spin_lock(&vi->qps[i].host_vfds_lock);
+		list_for_each_entry(vfd, &vi->qps[i].host_vfds, host_node) {
+			if (n == count)
+				break;
+			virtwl_restore_prepare(&restores[n++], vfd);
+		}
+		spin_unlock(&vi->qps[i].host_vfds_lock);
+	}
+	mutex_unlock(&vi->vfds_lock);
+
+	for (i = 0; i < vi->qp_count; i++) {
+		struct virtwl_vq_pair *qp = &vi->qps[i];
+
+		added = false;
+		mutex_lock(&qp->vq_locks[VIRTWL_VQ_OUT]);
+		for (j = 0; j < n; j++) {
+			restore = &restores[j];
+			if (restore->vfd->qp != qp)
+				continue;
+			restore->ret = vq_add_out_locked(qp, restore->sgs, 1, 1,
+							 &restore->req, false);
+			added |= !restore->ret;
+		}
+		if (added)
+			vq_kick(qp, VIRTWL_VQ_OUT);
+		mutex_unlock(&qp->vq_locks[VIRTWL_VQ_OUT]);
+	}
+
+	for (j = 0; j < n; j++) {
+		restore = &restores[j];
+		if (!restore->ret) {
+			wait_for_completion(&restore->req.finish_completion);
+			restore->ret = virtwl_resp_err(restore->ctrl.hdr.type);
+		}
+		if (restore->ret)
+			printk("virtwl: failed to restore vfd id %u: %d\n",
+			       restore->vfd->id, restore->ret);
+		virtwl_vfd_put(restore->vfd);
+	}
+
+	/* only once the host has every other restore */
+	restore = &restores[n];
+	virtwl_restore_prepare(restore, NULL);
+	restore->ret = vq_queue_out(&vi->qps[0], restore->sgs, 1, 1,
+				    &restore->req, false);
+	if (!restore->ret) {
+		wait_for_completion(&restore->req.finish_completion);
+		restore->ret = virtwl_resp_err(restore->ctrl.hdr.type);
+	}
+	if (restore->ret)
+		printk("virtwl: failed to end vfd restores: %d\n",
+		       restore->ret);
+
+	kfree(restores);
+}
+
+/*
+ * Keeps every vfd and in buffer across the reset: buffers the host had are
+ * saved for restore, and those held by vfds go back into in_saved when they
+ * are given back while frozen.
+ */
+static int virtwl_freeze(struct virtio_device *vdev)
+{
+	struct virtwl_info *vi = vdev->priv;
+	struct virtwl_vq_pair *qp;
+	struct virtqueue *vq;
+	unsigned int i;
+	void *buffer;
+
+	virtwl_close_flush(vi);
+	/* closes that failed to queue are retried once restored */
+	cancel_delayed_work_sync(&vi->close_work);
+
+	/* userspace is frozen, so nothing but what is in flight can be sent */
+	for (i = 0; i < vi->qp_count; i++) {
+		vq = vi->qps[i].vqs[VIRTWL_VQ_OUT];
+		if (!wait_event_timeout(vi->qps[i].out_waitq,
+					READ_ONCE(vq->num_free) ==
+					virtqueue_get_vring_size(vq), HZ)) {
+			printk("virtwl: timed out waiting for the out vq\n");
+			queue_delayed_work(vi->wq, &vi->close_work, 0);
+			return -EBUSY;
+		}
+	}
+
+	vdev->config->reset(vdev);
+	/* unlike a flush, this also waits for the in work requeueing itself */
+	drain_workqueue(vi->wq);
+
+	for (i = 0; i < vi->qp_count; i++) {
+		qp = &vi->qps[i];
+		mutex_lock(&qp->vq_locks[VIRTWL_VQ_IN]);
+		while ((buffer = virtqueue_detach_unused_buf(
+				qp->vqs[VIRTWL_VQ_IN]))) {
+			*(void **)buffer = qp->in_saved;
+			qp->in_saved = buffer;
+		}
+		WRITE_ONCE(qp->frozen, true);
+		mutex_unlock(&qp->vq_locks[VIRTWL_VQ_IN]);
+	}
+
+	/* nothing may touch the vqs after this, see the work handlers */
+	for (i = 0; i < vi->qp_count; i++) {
+		cancel_work_sync(&vi->qps[i].in_vq_work);
+		cancel_work_sync(&vi->qps[i].out_vq_work);
+	}
+
+	vdev->config->del_vqs(vdev);
+	return 0;
+}
+
+static int virtwl_restore(struct virtio_device *vdev)
+{
+	struct virtwl_info *vi = vdev->priv;
+	struct virtwl_vq_pair *qp;
+	unsigned int i;
+	void *buffer;
+	int ret;
+
+	ret = virtwl_find_vqs(vdev, vi);
+	if (ret) {
+		printk("virtwl: failed to find virtio wayland queues: %d\n",
+		       ret);
+		return ret;
+	}
+
+	/* the saved buffers go back first, only what's missing is allocated */
+	for (i = 0; i < vi->qp_count; i++) {
+		qp = &vi->qps[i];
+		mutex_lock(&qp->vq_locks[VIRTWL_VQ_IN]);
+		WRITE_ONCE(qp->frozen, false);
+		while ((buffer = qp->in_saved) &&
+		       qp->vqs[VIRTWL_VQ_IN]->num_free) {
+			qp->in_saved = *(void **)buffer;
+			if (vq_return_inbuf_locked(qp, buffer))
+				kfree(buffer);
+		}
+		while ((buffer = qp->in_saved)) {
+			qp->in_saved = *(void **)buffer;
+			kfree(buffer);
+		}
+		ret = vq_fill_locked(qp);
+		mutex_unlock(&qp->vq_locks[VIRTWL_VQ_IN]);
+		if (ret) {
+			printk("virtwl: failed to fill in virtqueue: %d", ret);
+			goto del_vqs;
+		}
+	}
+
+	virtio_device_ready(vdev);
+	virtwl_reannounce(vi);
+	for (i = 0; i < vi->qp_count; i++)
+		vq_kick(&vi->qps[i], VIRTWL_VQ_IN);
+	queue_delayed_work(vi->wq, &vi->close_work, 0);
+
+	return 0;
+
+del_vqs:
+	/* the queues before the one that failed still have their buffers */
+	while (i--)
+		vq_in_free_unused(&vi->qps[i]);
+	vdev->config->reset(vdev);
+	vdev->config->del_vqs(vdev);
+	for (i = 0; i < vi->qp_count; i++)
+		vi->qps[i].frozen = true;
+	return ret;
+}
+#endif
+
 
 static struct virtio_device_id id_table[] = {
 	{ VIRTIO_ID_WL, VIRTIO_DEV_ANY_ID },
 	{ 0 },
 };
 
+static unsigned int features[] = {
+	VIRTIO_WL_F_MQ,
+	VIRTIO_WL_F_HUGE_ALIGN,
+	VIRTIO_WL_F_CLOSE_BATCH,
+	VIRTIO_WL_F_MAX_VFD_ID,
+	VIRTIO_WL_F_IMPORT,
+	VIRTIO_WL_F_RESTORE,
+};
+
 static struct virtio_driver virtio_wl_driver = {
 	.driver.name =	KBUILD_MODNAME,
 	.driver.owner =	THIS_MODULE,
+	.feature_table = features,
+	.feature_table_size = ARRAY_SIZE(features),
 	.id_table =	id_table,
 	.probe =	virtwl_probe,
 	.remove =	virtwl_remove,
 	.scan =		virtwl_scan,
+#ifdef CONFIG_PM_SLEEP
+	.freeze =	virtwl_freeze,
+	.restore =	virtwl_restore,
+#endif
 };
 
 module_virtio_driver(virtio_wl_driver);
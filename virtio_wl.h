@@ -7,16 +7,45 @@
 #include "virtwl.h"
 
 
-#define VIRTWL_IN_BUFFER_SIZE 4096
+#define VIRTWL_IN_BUFFER_SIZE 4096 /* default and minimum */
+#define VIRTWL_IN_BUFFER_SIZE_MAX (1 << 20)
+/* in vq buffer bytes per queue pair unless the buffer count is given */
+#define VIRTWL_IN_BUFFER_BYTES_DEFAULT (4 << 20)
 #define VIRTWL_OUT_BUFFER_SIZE 4096
+/* queue pair n is made of virtqueues 2n (in) and 2n + 1 (out) */
 #define VIRTWL_VQ_IN 0
 #define VIRTWL_VQ_OUT 1
 #define VIRTWL_QUEUE_COUNT 2
+#define VIRTWL_MAX_QUEUE_PAIRS 16
 #define VIRTWL_MAX_ALLOC 0x800
 #define VIRTWL_PFN_SHIFT 12
 
-struct virtio_wl_config {
+/*
+ * Feature bits. None of these are from an agreed spec: the driver assigned
+ * them provisionally, and a device must be built against this header to
+ * offer them until they are allocated upstream.
+ */
+#define VIRTIO_WL_F_MQ 0 /* device has max_queue_pairs in/out queue pairs */
+#define VIRTIO_WL_F_HUGE_ALIGN 1 /* device honors VIRTIO_WL_VFD_HUGE_ALIGN */
+#define VIRTIO_WL_F_CLOSE_BATCH 2 /* device takes VIRTIO_WL_CMD_VFD_CLOSE_BATCH */
+#define VIRTIO_WL_F_MAX_VFD_ID 3 /* device has max_vfd_id */
+#define VIRTIO_WL_F_IMPORT 4 /* device takes VIRTIO_WL_CMD_VFD_IMPORT */
+#define VIRTIO_WL_F_RESTORE 5 /* device keeps VFDs across a reset, see below */
 
+struct virtio_wl_config {
+	/*
+	 * Valid with VIRTIO_WL_F_MQ. A context is bound to the queue pair its
+	 * VIRTIO_WL_CMD_VFD_NEW_CTX arrived on: the device must send recvs for
+	 * that context on the in queue of the same pair.
+	 */
+	__le16 max_queue_pairs;
+	__le16 padding;
+	/*
+	 * Valid with VIRTIO_WL_F_MAX_VFD_ID. Guest allocated VFD ids are below
+	 * this, which may be raised above VIRTWL_MAX_ALLOC up to the host VFD
+	 * id bit.
+	 */
+	__le32 max_vfd_id;
 };
 
 /*
@@ -28,6 +57,13 @@ enum virtio_wl_ctrl_type {
 	VIRTIO_WL_CMD_VFD_SEND, /* virtio_wl_ctrl_vfd_send + data */
 	VIRTIO_WL_CMD_VFD_RECV, /* virtio_wl_ctrl_vfd_recv + data */
 	VIRTIO_WL_CMD_VFD_NEW_CTX, /* virtio_wl_ctrl_vfd */
+	/*
+	 * Provisional, driver assigned values like the feature bits, only sent
+	 * when the matching feature is negotiated.
+	 */
+	VIRTIO_WL_CMD_VFD_CLOSE_BATCH, /* virtio_wl_ctrl_vfd_close_batch + ids */
+	VIRTIO_WL_CMD_VFD_IMPORT, /* virtio_wl_ctrl_vfd_import + extents */
+	VIRTIO_WL_CMD_VFD_RESTORE, /* virtio_wl_ctrl_vfd_restore */
 
 	VIRTIO_WL_RESP_OK = 0x1000,
 	VIRTIO_WL_RESP_VFD_NEW = 0x1001, /* virtio_wl_ctrl_vfd_new */
@@ -47,6 +83,11 @@ enum virtio_wl_vfd_flags {
 	VIRTIO_WL_VFD_WRITE = 0x1, /* indicates if mapped area is writable */
 	VIRTIO_WL_VFD_MAP = 0x2, /* indicates a fixed size and mapping into a pfn range */
 	VIRTIO_WL_VFD_CONTROL = 0x4, /* indicates if send/recv can transmit VFDs */
+	/*
+	 * In a new request, asks for pfn and size aligned to 2MiB if possible.
+	 * Provisional and driver assigned, like VIRTIO_WL_F_HUGE_ALIGN.
+	 */
+	VIRTIO_WL_VFD_HUGE_ALIGN = 0x8,
 };
 
 struct virtio_wl_ctrl_vfd {
@@ -69,6 +110,16 @@ struct virtio_wl_ctrl_vfd_new {
 	__le32 size; /* size in bytes if VIRTIO_WL_VFD_MAP */
 };
 
+/*
+ * With VIRTIO_WL_F_RESTORE, the device keeps its VFDs across a reset, such as
+ * the one of a guest suspend. Once the driver is ready again, it sends one
+ * VIRTIO_WL_CMD_VFD_RESTORE for each VFD it still has, with the properties it
+ * knows it by, on the queue pair a context is bound to. A restore with vfd_id
+ * 0 ends the list, and the device then closes every VFD that wasn't named.
+ * The response is VIRTIO_WL_RESP_OK or an error in the header.
+ */
+#define virtio_wl_ctrl_vfd_restore virtio_wl_ctrl_vfd_new
+
 struct virtio_wl_ctrl_vfd_send {
 	struct virtio_wl_ctrl_hdr hdr;
 	__le32 vfd_id;
@@ -83,4 +134,36 @@ struct virtio_wl_ctrl_vfd_recv {
 	/* the remainder is raw data */
 };
 
+/*
+ * Closes several VFDs at once, with VIRTIO_WL_F_CLOSE_BATCH. The response is
+ * VIRTIO_WL_RESP_OK only if every VFD was closed; VFDs that the host failed to
+ * close should be treated as closed anyway.
+ */
+struct virtio_wl_ctrl_vfd_close_batch {
+	struct virtio_wl_ctrl_hdr hdr;
+	__le32 vfd_count; /* struct is followed by this many IDs */
+};
+
+/*
+ * Creates a VFD, with VIRTIO_WL_F_IMPORT, out of guest memory that the guest
+ * already has, such as the pages of a dma-buf from another guest device. The
+ * memory is made of the runs of pages given by the extents, in order, which
+ * are addressed as the device addresses guest memory. The guest keeps the
+ * memory in place until the VFD is closed. The response is VIRTIO_WL_RESP_OK
+ * or an error in the header.
+ */
+struct virtio_wl_ctrl_vfd_import {
+	struct virtio_wl_ctrl_hdr hdr;
+	__le32 vfd_id; /* guest allocated, like for VIRTIO_WL_CMD_VFD_NEW */
+	__le32 flags; /* virtio_wl_vfd_flags, only VIRTIO_WL_VFD_WRITE */
+	__le32 size; /* in bytes, the sum of the extents */
+	__le32 extent_count; /* struct is followed by this many extents */
+};
+
+struct virtio_wl_vfd_extent {
+	__le64 pfn;
+	__le32 page_count;
+	__le32 padding;
+};
+
 #endif /* _LINUX_VIRTIO_WL_H */
@@ -0,0 +1,186 @@
+/*
+ *  Tracepoints for the Virtio Wayland Driver
+ *  Copyright (C) 2017 Google, Inc.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM virtio_wl
+
+#if !defined(_VIRTIO_WL_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _VIRTIO_WL_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/* A command added to an out vq, ret != 0 if it couldn't be. */
+TRACE_EVENT(virtwl_vq_add,
+	TP_PROTO(unsigned int qp, u32 type, u32 vfd_id, size_t bytes, int ret),
+	TP_ARGS(qp, type, vfd_id, bytes, ret),
+	TP_STRUCT__entry(
+		__field(unsigned int, qp)
+		__field(u32, type)
+		__field(u32, vfd_id)
+		__field(size_t, bytes)
+		__field(int, ret)
+	),
+	TP_fast_assign(
+		__entry->qp = qp;
+		__entry->type = type;
+		__entry->vfd_id = vfd_id;
+		__entry->bytes = bytes;
+		__entry->ret = ret;
+	),
+	TP_printk("qp=%u type=0x%x vfd_id=%u bytes=%zu ret=%d",
+		  __entry->qp, __entry->type, __entry->vfd_id, __entry->bytes,
+		  __entry->ret)
+);
+
+TRACE_EVENT(virtwl_vq_kick,
+	TP_PROTO(unsigned int qp, unsigned int vq),
+	TP_ARGS(qp, vq),
+	TP_STRUCT__entry(
+		__field(unsigned int, qp)
+		__field(unsigned int, vq)
+	),
+	TP_fast_assign(
+		__entry->qp = qp;
+		__entry->vq = vq;
+	),
+	TP_printk("qp=%u vq=%s", __entry->qp, __entry->vq ? "out" : "in")
+);
+
+/* The host returned an out command, latency is since it was added. */
+TRACE_EVENT(virtwl_out_complete,
+	TP_PROTO(unsigned int qp, u32 type, u32 vfd_id, u32 resp,
+		 u64 latency_ns),
+	TP_ARGS(qp, type, vfd_id, resp, latency_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, qp)
+		__field(u32, type)
+		__field(u32, vfd_id)
+		__field(u32, resp)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->qp = qp;
+		__entry->type = type;
+		__entry->vfd_id = vfd_id;
+		__entry->resp = resp;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("qp=%u type=0x%x vfd_id=%u resp=0x%x latency_ns=%llu",
+		  __entry->qp, __entry->type, __entry->vfd_id, __entry->resp,
+		  __entry->latency_ns)
+);
+
+TRACE_EVENT(virtwl_out_work,
+	TP_PROTO(unsigned int qp, unsigned int reaped),
+	TP_ARGS(qp, reaped),
+	TP_STRUCT__entry(
+		__field(unsigned int, qp)
+		__field(unsigned int, reaped)
+	),
+	TP_fast_assign(
+		__entry->qp = qp;
+		__entry->reaped = reaped;
+	),
+	TP_printk("qp=%u reaped=%u", __entry->qp, __entry->reaped)
+);
+
+TRACE_EVENT(virtwl_in_work,
+	TP_PROTO(unsigned int qp, unsigned int handled, bool requeue),
+	TP_ARGS(qp, handled, requeue),
+	TP_STRUCT__entry(
+		__field(unsigned int, qp)
+		__field(unsigned int, handled)
+		__field(bool, requeue)
+	),
+	TP_fast_assign(
+		__entry->qp = qp;
+		__entry->handled = handled;
+		__entry->requeue = requeue;
+	),
+	TP_printk("qp=%u handled=%u requeue=%d", __entry->qp,
+		  __entry->handled, __entry->requeue)
+);
+
+/* A command from the host taken off an in vq. */
+TRACE_EVENT(virtwl_dispatch,
+	TP_PROTO(unsigned int qp, u32 type, u32 vfd_id, unsigned int len),
+	TP_ARGS(qp, type, vfd_id, len),
+	TP_STRUCT__entry(
+		__field(unsigned int, qp)
+		__field(u32, type)
+		__field(u32, vfd_id)
+		__field(unsigned int, len)
+	),
+	TP_fast_assign(
+		__entry->qp = qp;
+		__entry->type = type;
+		__entry->vfd_id = vfd_id;
+		__entry->len = len;
+	),
+	TP_printk("qp=%u type=0x%x vfd_id=%u len=%u", __entry->qp,
+		  __entry->type, __entry->vfd_id, __entry->len)
+);
+
+TRACE_EVENT(virtwl_new,
+	TP_PROTO(u32 vfd_id, u32 flags, u32 size, int ret, u64 latency_ns),
+	TP_ARGS(vfd_id, flags, size, ret, latency_ns),
+	TP_STRUCT__entry(
+		__field(u32, vfd_id)
+		__field(u32, flags)
+		__field(u32, size)
+		__field(int, ret)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->vfd_id = vfd_id;
+		__entry->flags = flags;
+		__entry->size = size;
+		__entry->ret = ret;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("vfd_id=%u flags=0x%x size=%u ret=%d latency_ns=%llu",
+		  __entry->vfd_id, __entry->flags, __entry->size, __entry->ret,
+		  __entry->latency_ns)
+);
+
+/* One close command, for vfd_count vfds starting with vfd_id. */
+TRACE_EVENT(virtwl_close,
+	TP_PROTO(u32 vfd_id, unsigned int vfd_count, int ret, u64 latency_ns),
+	TP_ARGS(vfd_id, vfd_count, ret, latency_ns),
+	TP_STRUCT__entry(
+		__field(u32, vfd_id)
+		__field(unsigned int, vfd_count)
+		__field(int, ret)
+		__field(u64, latency_ns)
+	),
+	TP_fast_assign(
+		__entry->vfd_id = vfd_id;
+		__entry->vfd_count = vfd_count;
+		__entry->ret = ret;
+		__entry->latency_ns = latency_ns;
+	),
+	TP_printk("vfd_id=%u vfd_count=%u ret=%d latency_ns=%llu",
+		  __entry->vfd_id, __entry->vfd_count, __entry->ret,
+		  __entry->latency_ns)
+);
+
+#endif /* _VIRTIO_WL_TRACE_H */
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE virtio_wl_trace
+#include <trace/define_trace.h>
@@ -17,10 +17,36 @@ enum virtwl_ioctl_new_type {
 	VIRTWL_IOCTL_NEW_ALLOC, /* create a new virtwl shm allocation */
 };
 
+enum virtwl_ioctl_new_flags {
+	/*
+	 * VIRTWL_IOCTL_NEW_CTX only: VIRTWL_IOCTL_SEND returns as soon as the
+	 * message is queued. A failure is returned by the next send on the
+	 * context and is signaled as POLLERR until then.
+	 */
+	VIRTWL_IOCTL_NEW_CTX_ASYNC_SEND = 0x1,
+	/*
+	 * VIRTWL_IOCTL_NEW_ALLOC only: ask the host to place the allocation
+	 * on a 2MiB boundary, so the host can back it with huge pages.
+	 */
+	VIRTWL_IOCTL_NEW_ALLOC_HUGE = 0x2,
+	/*
+	 * VIRTWL_IOCTL_NEW_ALLOC only: how mappings of the allocation are
+	 * cached, one of the values under VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK.
+	 */
+	VIRTWL_IOCTL_NEW_ALLOC_CACHED = 0x0, /* default */
+	VIRTWL_IOCTL_NEW_ALLOC_WC = 0x4, /* write-combined */
+	VIRTWL_IOCTL_NEW_ALLOC_UC = 0x8, /* uncached */
+	VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK = 0xc,
+};
+
+#define VIRTWL_IOCTL_NEW_CTX_FLAGS VIRTWL_IOCTL_NEW_CTX_ASYNC_SEND
+#define VIRTWL_IOCTL_NEW_ALLOC_FLAGS \
+	(VIRTWL_IOCTL_NEW_ALLOC_HUGE | VIRTWL_IOCTL_NEW_ALLOC_CACHING_MASK)
+
 struct virtwl_ioctl_new {
 	__u32 type; /* VIRTWL_IOCTL_NEW_* */
 	int fd; /* return fd */
-	__u32 flags; /* currently always 0 */
+	__u32 flags; /* virtwl_ioctl_new_flags valid for type */
 	__u32 size; /* size of allocation if type == VIRTWL_IOCTL_NEW_ALLOC */
 };
 
@@ -30,10 +56,122 @@ struct virtwl_ioctl_txn {
 	__u8 data[0];
 };
 
+/*
+ * Like virtwl_ioctl_txn, but the data is scattered over or gathered into an
+ * array of struct iovec instead of following the struct.
+ */
+struct virtwl_ioctl_txnv {
+	int fds[VIRTWL_SEND_MAX_ALLOCS];
+	__u32 len; /* bytes received, unused for send */
+	__u32 iovcnt; /* at most UIO_MAXIOV */
+	__u64 iov; /* pointer to struct iovec[iovcnt] */
+};
+
+/*
+ * Like virtwl_ioctl_txn, but the fds are an array of fd_count ints on the
+ * caller's side, so a txn without fds copies none. For recv, fd_count and len
+ * are the capacity of fds and data going in and what was received coming out.
+ */
+struct virtwl_ioctl_txnx {
+	__u32 fd_count; /* at most VIRTWL_SEND_MAX_ALLOCS for send */
+	__u32 len;
+	__u64 fds; /* pointer to int[fd_count] */
+	__u64 data; /* pointer to len bytes */
+};
+
+#define VIRTWL_SEND_BATCH_MAX 64
+
+struct virtwl_ioctl_batch_txn {
+	int fd; /* context VFD to send on */
+	int fds[VIRTWL_SEND_MAX_ALLOCS];
+	__u32 len;
+	__u64 data; /* pointer to len bytes */
+};
+
+struct virtwl_ioctl_send_batch {
+	__u32 count; /* number of txns, at most VIRTWL_SEND_BATCH_MAX */
+	__u32 pad;
+	__u64 txns; /* pointer to struct virtwl_ioctl_batch_txn[count] */
+};
+
+#define VIRTWL_NEW_MULTI_MAX 8
+
+/* Creates count allocations of the same size and flags in one round trip. */
+struct virtwl_ioctl_new_multi {
+	__u32 count; /* at most VIRTWL_NEW_MULTI_MAX */
+	__u32 flags; /* virtwl_ioctl_new_flags valid for VIRTWL_IOCTL_NEW_ALLOC */
+	__u32 size; /* size of each allocation */
+	int fds[VIRTWL_NEW_MULTI_MAX]; /* return fds */
+};
+
+#define VIRTWL_RING_MAX_SLOTS 256
+
+/* Turns on the ring of a context VFD, see struct virtwl_ring_hdr. */
+struct virtwl_ioctl_ring_setup {
+	__u32 slot_count; /* slots in each of sq and cq, a power of two */
+	__u32 flags; /* must be 0 */
+};
+
+/*
+ * The first page of the ring, which is mapped from offset 0 of the context
+ * VFD. It is followed by the pages of the sq slots, then those of the cq
+ * slots, each slot being one slot_size page that starts with a struct
+ * virtwl_ring_slot. Indices run freely and are masked by slot_count - 1.
+ *
+ * The sq carries messages without fds to the host: the user fills the slots
+ * from sq_tail on, advances sq_tail and issues VIRTWL_IOCTL_RING_KICK. The
+ * driver advances sq_head once the host is done with a slot. The cq carries
+ * received messages without fds while nothing is queued for
+ * VIRTWL_IOCTL_RECV, but only until the first recv or read on the context.
+ * From then on every message is queued for those, so the cq must be drained
+ * before the first recv to keep messages in order.
+ */
+struct virtwl_ring_hdr {
+	__u32 sq_head; /* written by the driver */
+	__u32 sq_tail; /* written by the user */
+	__u32 cq_head; /* written by the user */
+	__u32 cq_tail; /* written by the driver */
+	__u32 slot_count;
+	__u32 slot_size;
+	__u32 sq_offset; /* offsets of the slot arrays in the mapping */
+	__u32 cq_offset;
+	__s32 sq_err; /* first failed send as a negative errno, user clears */
+};
+
+struct virtwl_ring_slot {
+	__u32 len; /* of data, at most slot_size - sizeof(struct virtwl_ring_slot) */
+	__u32 pad;
+	__u8 data[0];
+};
+
+/*
+ * For VIRTWL_IOCTL_DMABUF_EXPORT, fd is the returned dma-buf of an allocation
+ * VFD, on which the ioctl is issued. The dma-buf keeps the VFD open.
+ *
+ * For VIRTWL_IOCTL_DMABUF_IMPORT, fd is a dma-buf going in and the returned
+ * VFD coming out, which can be sent like an allocation VFD and mapped like
+ * the dma-buf. This needs a host with VIRTIO_WL_F_IMPORT and a dma-buf whose
+ * memory is page aligned and addressable by the device.
+ */
+struct virtwl_ioctl_dmabuf {
+	int fd;
+	__u32 flags; /* must be 0 */
+};
+
 #define VIRTWL_IOCTL_NEW VIRTWL_IOWR(0x00, struct virtwl_ioctl_new)
 #define VIRTWL_IOCTL_SEND VIRTWL_IOR(0x01, struct virtwl_ioctl_txn)
 #define VIRTWL_IOCTL_RECV VIRTWL_IOW(0x02, struct virtwl_ioctl_txn)
-#define VIRTWL_IOCTL_MAXNR 3
+#define VIRTWL_IOCTL_SEND_BATCH VIRTWL_IOW(0x03, struct virtwl_ioctl_send_batch)
+#define VIRTWL_IOCTL_SENDV VIRTWL_IOW(0x04, struct virtwl_ioctl_txnv)
+#define VIRTWL_IOCTL_RECVV VIRTWL_IOWR(0x05, struct virtwl_ioctl_txnv)
+#define VIRTWL_IOCTL_NEW_MULTI VIRTWL_IOWR(0x06, struct virtwl_ioctl_new_multi)
+#define VIRTWL_IOCTL_SENDX VIRTWL_IOW(0x07, struct virtwl_ioctl_txnx)
+#define VIRTWL_IOCTL_RECVX VIRTWL_IOWR(0x08, struct virtwl_ioctl_txnx)
+#define VIRTWL_IOCTL_RING_SETUP VIRTWL_IOW(0x09, struct virtwl_ioctl_ring_setup)
+#define VIRTWL_IOCTL_RING_KICK VIRTWL_IO(0x0a)
+#define VIRTWL_IOCTL_DMABUF_EXPORT VIRTWL_IOWR(0x0b, struct virtwl_ioctl_dmabuf)
+#define VIRTWL_IOCTL_DMABUF_IMPORT VIRTWL_IOWR(0x0c, struct virtwl_ioctl_dmabuf)
+#define VIRTWL_IOCTL_MAXNR 13
 
 
 #endif /* _LINUX_VIRTWL_H */